@@ -49,18 +49,19 @@ typedef union {
     };
 } pec_section1_t;
 
+// Stitch data follows immediately after.
 typedef union {
-    uint8_t buf[36];
+    uint8_t buf[20];
     struct {
         uint16_t unknown_1;
         uint16_t thumbnail_offset;
         uint16_t unknown_2;
         uint16_t unknown_3;
-        int16_t width; // mm / 10
-        int16_t height; // mm / 10
+        uint16_t width; // mm / 10
+        uint16_t height; // mm / 10
         uint16_t unknown_4;
         uint16_t unknown_5;
-        uint8_t unknown_6[4];
+        uint8_t unknown_6[4]; // origin offset
     };
 } pec_section2_t;
 
@@ -159,109 +160,127 @@ static const char *get_thread_color (embroidery_thread_color_t color)
     return palette_thread_list[color >= sizeof(palette_thread_list) / sizeof(struct pec_thread) ? 0 : color].name;
 }
 
-static bool get_stitch (stitch_t *stitch, vfs_file_t *file)
+// State is the color index, bit 31 is set if the initial color has yet to be reported.
+static uint32_t get_state (void)
 {
-    uint8_t cmd;
-    bool eof;
+    return (uint32_t)color_idx | (first_color != -1 ? bit(31) : 0);
+}
+
+static void set_state (uint32_t state)
+{
+    color_idx = (int32_t)(state & 0xFFFF);
+    first_color = (state & bit(31)) ? (int32_t)pec_1.palette_index[0] : -1;
+}
+
+static bool get_stitch (stitch_t *stitch, stitch_reader_t *reader)
+{
+    int16_t cmd;
     int16_t dx = 0, dy = 0;
 
     if(first_color != -1) {
 
         stitch->type = Stitch_Stop;
         stitch->color = (embroidery_thread_color_t)first_color;
-        stitch->target.x = stitch->target.y = 0.0f;
+        stitch->delta.x = stitch->delta.y = 0;
         first_color = -1;
 
         return true;
     }
 
-    vfs_read(&cmd, 1, 1, file);
+    // Records may straddle a buffer boundary, stitch_reader_getc() refills transparently.
+    if((cmd = stitch_reader_getc(reader)) == -1 || cmd == 0xFF)
+        return false;
 
     stitch->type = Stitch_Normal;
 
-    if(!(eof = cmd == 0xFF)) {
-
-        // parse x
-        if(cmd & 0x80) {
+    // parse x
+    if(cmd & 0x80) {
 
-            if(cmd == 0xFE) {
+        if(cmd == 0xFE) {
 
-                stitch->type = Stitch_Stop;
-                vfs_read(&cmd, 1, 1, file);
-                vfs_read(&cmd, 1, 1, file);
-                color_idx++;
-                stitch->color = (embroidery_thread_color_t)pec_1.palette_index[color_idx];
-                stitch->target.x = stitch->target.y = 0.0f;
-                return true;
+            stitch->type = Stitch_Stop;
+            if(stitch_reader_getc(reader) == -1 || stitch_reader_getc(reader) == -1) // skip 0xB0 and color index
+                return false;
+            color_idx++;
+            stitch->color = (embroidery_thread_color_t)pec_1.palette_index[color_idx];
+            stitch->delta.x = stitch->delta.y = 0;
+            return true;
 
-            } else {
+        } else {
 
-                stitch->type = (cmd & 0x20) ? Stitch_Trim : ((cmd & 0x10) ? Stitch_Jump : Stitch_Normal);
+            stitch->type = (cmd & 0x20) ? Stitch_Trim : ((cmd & 0x10) ? Stitch_Jump : Stitch_Normal);
 
-//                if(stitch->type == Stitch_Trim)
-//                    stitch->trims++;
+//            if(stitch->type == Stitch_Trim)
+//                stitch->trims++;
 
-                dx = (cmd & 0xF) << 8;
-                vfs_read(&cmd, 1, 1, file);
-                if((dx |= cmd) > 0x7ff)
-                    dx -= 0x1000;
-            }
+            dx = (cmd & 0xF) << 8;
+            if((cmd = stitch_reader_getc(reader)) == -1)
+                return false;
+            if((dx |= cmd) > 0x7ff)
+                dx -= 0x1000;
+        }
 
-            vfs_read(&cmd, 1, 1, file);
+    } else if((dx = cmd) > 0x3F)
+        dx -= 0x80;
 
-        } else {
-            if((dx = cmd) > 0x3F)
-                dx -= 0x80;
-            vfs_read(&cmd, 1, 1, file);
-        }
+    if((cmd = stitch_reader_getc(reader)) == -1)
+        return false;
 
-        //parse y
-        if(cmd & 0x80) {
+    //parse y
+    if(cmd & 0x80) {
 
-            stitch->type = (cmd & 0x20) ? Stitch_Trim : ((cmd & 0x10) ? Stitch_Jump : Stitch_Normal);
+        stitch->type = (cmd & 0x20) ? Stitch_Trim : ((cmd & 0x10) ? Stitch_Jump : Stitch_Normal);
 
-            dy = (cmd & 0xF) << 8;
-            vfs_read(&cmd, 1, 1, file);
-            if((dy |= cmd) > 0x7ff)
-                dy -= 0x1000;
+        dy = (cmd & 0xF) << 8;
+        if((cmd = stitch_reader_getc(reader)) == -1)
+            return false;
+        if((dy |= cmd) > 0x7ff)
+            dy -= 0x1000;
 
-        } else {
-            if((dy = cmd) > 0x3F)
-                dy -= 0x80;
-        }
+    } else if((dy = cmd) > 0x3F)
+        dy -= 0x80;
 
-        stitch->target.x = (float)dx / 10.0f;
-        stitch->target.y = (float)-dy / 10.0f;
-    }
+    stitch->delta.x = dx;
+    stitch->delta.y = -dy;
 
-    return !eof;
+    return true;
 }
 
-bool brother_open_file (vfs_file_t *file, embroidery_t *api)
+bool brother_open_file (stitch_reader_t *reader, embroidery_t *api)
 {
     bool ok = false;
+    uint_fast8_t idx;
     pes_header_t header;
 
-    if(vfs_read(header.buf, sizeof(pes_header_t), 1, file) == sizeof(pes_header_t) && !strncmp(header.version, "#PES", 4)) {
+    if(stitch_reader_read(reader, header.buf, sizeof(pes_header_t)) == sizeof(pes_header_t) && !strncmp(header.version, "#PES", 4)) {
 
-        vfs_seek(file, header.pec_offset);
+        stitch_reader_seek(reader, header.pec_offset);
 
-        vfs_read(pec_1.buf, sizeof(pec_section1_t), 1, file);
-        vfs_read(pec_2.buf, sizeof(pec_section2_t), 1, file);
+        stitch_reader_read(reader, pec_1.buf, sizeof(pec_section1_t));
+        stitch_reader_read(reader, pec_2.buf, sizeof(pec_section2_t));
 
         color_idx = 0;
 
+        // Label is padded with spaces and terminated by a CR.
+        idx = sizeof(pec_1.label) - 1;
+        do {
+            pec_1.label[idx] = '\0';
+        } while(idx && pec_1.label[--idx] == ' ');
+
         api->name = pec_1.label;
-        api->size.x = pec_2.width;
-        api->size.y = pec_2.height;
+        api->size.x = (float)pec_2.width / 10.0f;
+        api->size.y = (float)pec_2.height / 10.0f;
 
         api->get_stitch = get_stitch;
+        api->get_stitches = NULL;
+        api->get_state = get_state;
+        api->set_state = set_state;
         api->get_thread_color = get_thread_color;
         first_color = (embroidery_thread_color_t)pec_1.palette_index[0];
 
         ok = true;
     } else
-        vfs_seek(file, 0);
+        stitch_reader_seek(reader, 0);
 
     return ok;
 }
@@ -22,6 +22,7 @@
 */
 
 #include "embroidery.h"
+#include "profile.h"
 
 #if EMBROIDERY_ENABLE
 
@@ -29,14 +30,98 @@
 #error "Embroidery plugin requires SD card plugin enabled!"
 #endif
 
+#include <stdlib.h>
+#include <math.h>
+
 #include "grbl/motion_control.h"
 #include "grbl/protocol.h"
 #include "grbl/nvs_buffer.h"
 
-#define STITCH_QUEUE_SIZE 8 // must be a power of 2
+#ifndef EMBROIDERY_QUEUE_SIZE
+#define EMBROIDERY_QUEUE_SIZE 128 // stitch look-ahead, must be a power of 2. Size according to available RAM, 4 bytes per stitch.
+#endif
+#ifndef EMBROIDERY_REFILL_BUDGET
+#define EMBROIDERY_REFILL_BUDGET 2 // max time in ms spent decoding stitches per stream poll
+#endif
+#ifndef EMBROIDERY_MOVE_WINDOW
+#define EMBROIDERY_MOVE_WINDOW 40 // part of needle period, in percent, available for XY motion with adaptive feedrate
+#endif
+#ifndef EMBROIDERY_SPEED_LOOKAHEAD
+#define EMBROIDERY_SPEED_LOOKAHEAD 8 // number of queued stitches checked by needle speed control
+#endif
+#ifndef EMBROIDERY_RAMP_STITCHES
+#define EMBROIDERY_RAMP_STITCHES 4 // number of stitches to ramp needle speed down to minimum over before it is stopped
+#endif
+#ifndef EMBROIDERY_NEEDLE_RPM_MIN
+#define EMBROIDERY_NEEDLE_RPM_MIN 200.0f // lower limit for needle speed control
+#endif
+#ifndef EMBROIDERY_NEEDLE_WRAP
+#define EMBROIDERY_NEEDLE_WRAP 100 // rotary needle axis, max number of needle revolutions before Z is re-zeroed
+#endif
+#ifndef EMBROIDERY_TRIGGER_RING
+#define EMBROIDERY_TRIGGER_RING 16 // needle trigger timestamp buffer size, must be a power of 2
+#endif
+#ifndef EMBROIDERY_DECODE_BATCH
+#define EMBROIDERY_DECODE_BATCH 8 // stitches per batch for readers that support batch decoding
+#endif
+#ifndef EMBROIDERY_MIN_STITCH
+#define EMBROIDERY_MIN_STITCH 3 // mm / 10, shorter stitches are merged into the next when optimizing
+#endif
+#ifndef EMBROIDERY_MAX_STITCH
+#define EMBROIDERY_MAX_STITCH 30 // mm / 10, max length of collinear stitches combined when optimizing
+#endif
+#ifndef EMBROIDERY_DECODER_TASK
+#define EMBROIDERY_DECODER_TASK 0 // set to 1 to run decoding in a task on the other core, ESP32 only
+#endif
+#ifndef EMBROIDERY_TRANSFORM
+#define EMBROIDERY_TRANSFORM 1 // set to 0 to disable design offset, rotation, scaling and mirroring by $EMBT
+#endif
+#ifndef EMBROIDERY_TRIM_TIME
+#define EMBROIDERY_TRIM_TIME 2000 // ms, time per trim used for cycle time estimates
+#endif
+#ifndef EMBROIDERY_COLOR_CHANGE_TIME
+#define EMBROIDERY_COLOR_CHANGE_TIME 20000 // ms, time per thread change used for cycle time estimates
+#endif
+#ifndef EMBROIDERY_BACKTRACK
+#define EMBROIDERY_BACKTRACK 10 // max value of the thread break back-track setting, stitches backed up and sewn again after a thread break
+#endif
+#ifndef EMBROIDERY_DISPATCH_MAX
+#define EMBROIDERY_DISPATCH_MAX 4 // max stitches dispatched to the planner per realtime loop call
+#endif
+
+#if EMBROIDERY_QUEUE_SIZE < 4 || (EMBROIDERY_QUEUE_SIZE & (EMBROIDERY_QUEUE_SIZE - 1))
+#error "EMBROIDERY_QUEUE_SIZE must be a power of 2 and >= 4!"
+#endif
+
+#if EMBROIDERY_TRIGGER_RING & (EMBROIDERY_TRIGGER_RING - 1)
+#error "EMBROIDERY_TRIGGER_RING must be a power of 2!"
+#endif
+
+#if EMBROIDERY_DECODER_TASK
+#ifndef ESP_PLATFORM
+#error "EMBROIDERY_DECODER_TASK is only supported on ESP32!"
+#endif
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+#define STITCH_QUEUE_SIZE EMBROIDERY_QUEUE_SIZE
 
-extern bool brother_open_file (vfs_file_t *file, embroidery_t *api);
-extern bool tajima_open_file (vfs_file_t *file, embroidery_t *api);
+// Single producer, single consumer stitch queue: head is written by the decoder only, tail by dispatch only.
+// Acquire/release ordering ensures a stitch is written before head is advanced past it and read before tail is,
+// required when the decoder runs on another core.
+#define QUEUE_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define QUEUE_STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+#define TRIGGER_HISTOGRAM_BINS 6  // period deviation from filtered period: < 1, 2, 4, 8, 16 and >= 16%
+#define TRIGGER_TIMEOUT 2000000   // us, longer periods are needle restarts and not included in statistics
+#define OPTIONS_MASK 0x1F // options stored in embroidery_options_t, the upper bits of the options setting is the jump mode
+#define TRANSFORM_SCALE_MIN 0.1f
+#define TRANSFORM_SCALE_MAX 2.0f  // transformed deltas of max length packed stitches has to fit in stitch_delta_t
+#define TRANSFORM_OFFSET_MAX ((float)STITCH_PACKED_MAX / 10.0f) // mm, the origin and resume moves add the offset to a transformed packed delta
+
+extern bool brother_open_file (stitch_reader_t *reader, embroidery_t *api);
+extern bool tajima_open_file (stitch_reader_t *reader, embroidery_t *api);
+extern bool native_open_file (stitch_reader_t *reader, embroidery_t *api);
 
 typedef enum {
     EmbroideryTrig_Falling = 0,
@@ -44,6 +129,25 @@ typedef enum {
     EmbroideryTrig_ZLimit
 } embroidery_trig_t;
 
+typedef enum {
+    EmbroideryJump_Hold = 0,    // stop needle and feed hold on jumps after stitching
+    EmbroideryJump_StopNeedle,  // stop needle and continue with rapid motion
+    EmbroideryJump_Merge,       // as above, consecutive jumps are merged to a single move
+    EmbroideryJump_MergeTrims   // as above, the move of a trim is merged with the following jumps
+} embroidery_jump_mode_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t prescan       :1,
+                rotary_needle :1,
+                adaptive_feed :1,
+                cache         :1,
+                optimize      :1,
+                unused        :3;
+    };
+} embroidery_options_t;
+
 typedef struct {
     float feedrate;
     float z_travel;
@@ -52,13 +156,96 @@ typedef struct {
     uint16_t stop_delay;
     embroidery_trig_t edge;
     uint8_t debug_port;
+    embroidery_jump_mode_t jump_mode;
+    embroidery_options_t options;
+    float needle_speed;
+    uint8_t break_port;
+    uint8_t backtrack;
 } embroidery_settings_t;
 
+typedef struct {
+    volatile uint_fast16_t head;
+    volatile uint_fast16_t tail;
+    stitch_packed_t stitch[STITCH_QUEUE_SIZE];
+} stitch_queue_t;
+
+typedef struct {
+    bool eof;
+    uint_fast16_t idx;
+    uint_fast16_t len;
+    stitch_t stitch[EMBROIDERY_DECODE_BATCH];
+} stitch_batch_t;
+
+typedef struct {
+    bool eof;
+    uint_fast8_t idx;
+    uint_fast8_t count;
+    stitch_t stitch[2];
+} stitch_merge_t;
+
+typedef struct {
+    bool held;
+    stitch_t next;
+    uint32_t micro;     // number of stitches shorter than EMBROIDERY_MIN_STITCH merged into a neighbour
+    uint32_t collinear; // number of collinear stitches combined
+} stitch_optimizer_t;
+
+typedef struct {
+    bool pending;
+    bool block;
+    uint32_t value;
+    stitch_position_t move; // part of the move to the resume position not yet injected
+} embroidery_resume_t;
+
+// Recently dispatched stitches, for back-tracking on thread break.
+// Only stitches since the last jump, trim or stop are kept so that back-tracking is a single move.
+typedef struct {
+    uint_fast8_t head;
+    uint_fast8_t count;
+    stitch_packed_t stitch[EMBROIDERY_BACKTRACK];
+} stitch_history_t;
+
+// Stitches to be sewn again after a thread break, dispatched ahead of the queue.
+// A break during replay backs up over replayed stitches only, the length is thus never more than EMBROIDERY_BACKTRACK.
+typedef struct {
+    uint_fast8_t idx;
+    uint_fast8_t len;
+    stitch_packed_t stitch[EMBROIDERY_BACKTRACK];
+} stitch_replay_t;
+
+#if EMBROIDERY_TRANSFORM
+
+// Design transform, mirror and scale then rotate about the design origin and offset.
+// The matrix is fixed point with 16 fractional bits, the offset is in mm / 10.
+typedef struct {
+    bool identity;
+    bool mirror_x;
+    bool mirror_y;
+    float rotation;     // degrees
+    float scale;
+    int32_t a, b, c, d; // x' = a * x + b * y, y' = c * x + d * y
+    stitch_position_t offset;
+} embroidery_transform_t;
+
+#endif
+
+// Single producer (trigger interrupt), single consumer (foreground) ring of trigger timestamps in microseconds.
 typedef struct {
     volatile uint_fast8_t head;
     volatile uint_fast8_t tail;
-    stitch_t stitch[STITCH_QUEUE_SIZE];
-} stitch_queue_t;
+    uint32_t overruns;
+    uint32_t us[EMBROIDERY_TRIGGER_RING];
+} trigger_ring_t;
+
+typedef struct {
+    uint32_t last;
+    uint32_t count;
+    uint32_t period_min;
+    uint32_t period_max;
+    float period;       // filtered, us
+    float jitter;       // filtered absolute deviation from period, us
+    uint32_t histogram[TRIGGER_HISTOGRAM_BINS];
+} trigger_stats_t;
 
 typedef struct {
     uint32_t jumps;
@@ -68,6 +255,18 @@ typedef struct {
     uint32_t sequin_ejects;
 } embroidery_job_details_t;
 
+// Batch mode, the design is sewn repeatedly from the same decoder restart point without reopening the file.
+typedef struct {
+    uint32_t requested;     // pieces to sew in the next job, set by $EMBB
+    uint32_t pieces;
+    uint32_t piece;         // current piece, the first is 0
+    float pause;            // hoop change pause in seconds, 0 waits for cycle start
+    coord_data_t step;      // origin offset between pieces, mm
+    uint32_t offset;        // restart point, taken at the start of stitch data
+    uint32_t state;
+    embroidery_job_details_t executed; // completed pieces
+} embroidery_repeat_t;
+
 typedef struct {
     bool enqueued;
     bool completed;
@@ -78,21 +277,48 @@ typedef struct {
     uint32_t trigger_interval, trigger_interval_min;
     uint32_t last_trigger;
     uint32_t stitch_interval;
+    uint32_t speed_errs;
+    uint32_t queue_empty;       // number of times the stitch queue ran dry while stitching
+    uint32_t planner_starved;   // number of times motion stopped while stitching with no trigger to wait for
+    uint32_t decode_us;         // total time spent decoding
+    uint32_t decoded;           // number of stitches enqueued
+    bool starving;
+    bool out_of_range;
+    bool prefetching;           // prefetch of the next file block is queued as a foreground task
+    volatile bool thread_break;
+    uint32_t thread_breaks;
+    uint32_t backtracked;       // number of stitches sewn again after thread breaks
+    uint_fast16_t planner_blocks; // planner buffer size, max free blocks seen
+    stich_type_t op;                        // Stitch_Trim or Stitch_Stop while an asynchronous operation is pending
+    bool op_started;
+    volatile embroidery_op_status_t op_status;
+    float needle_rpm;
+    float speed_scale;
     embroidery_job_details_t programmed;
     embroidery_job_details_t executed;
+    embroidery_job_details_t merged;
     uint32_t errs, exced;
     uint32_t spindle_stop;
     spindle_state_t spindle;
     volatile sys_state_t machine_state;
     vfs_file_t *file;
+    vfs_file_t *cache;          // native format cache the design is read from, owned by the plugin
     plan_line_data_t plan_data;
+    coord_data_t origin;
     coord_data_t position;
+    stitch_position_t stitch_pos;
+#if EMBROIDERY_TRANSFORM
+    stitch_position_t transformed;  // stitch_pos after transform, relative to origin
+#endif
+    uint32_t needle_turns;
     embroidery_thread_color_t color;
     stitch_queue_t queue;
+    stitch_history_t history;
+    stitch_replay_t replay;
 } embroidery_job_t;
 
-static uint8_t port, debug_port, n_din, n_dout;
-static char max_port[4], max_out_port[4];
+static uint8_t port, debug_port, break_port = 0xFF, n_din, n_dout;
+static char max_port[4], max_out_port[4], max_backtrack[4];
 static uint32_t nvs_address;
 
 static io_stream_t active_stream;
@@ -102,23 +328,205 @@ static on_report_options_ptr on_report_options;
 static on_state_change_ptr on_state_change;
 static on_execute_realtime_ptr on_execute_realtime;
 static on_file_open_ptr on_file_open;
+static on_realtime_report_ptr on_realtime_report;
 static driver_reset_ptr driver_reset;
 static limit_interrupt_callback_ptr limits_interrupt_callback;
 static embroidery_job_t job = {0};
+static stitch_reader_t reader;
+static stitch_batch_t batch;
+static stitch_merge_t merge;
+static stitch_optimizer_t optimizer;
+static embroidery_index_t design_index;
+static bool design_native = false;
+static embroidery_resume_t resume = {0};
+static embroidery_repeat_t repeat = {0};
+#if EMBROIDERY_TRANSFORM
+static embroidery_transform_t transform = { .identity = true, .scale = 1.0f };
+#endif
+static trigger_ring_t triggers = {0};
+static trigger_stats_t trigger_stats;
+static uint32_t (*get_micros)(void);
 
 static bool spindle_control (bool on)
 {
     if(job.spindle.on != on) {
         job.spindle.on = on;
         if(embroidery.sync_mode)
-            job.plan_data.spindle.hal->set_state(job.plan_data.spindle.hal, job.spindle, job.spindle.on ? 1.0f : 0.0f);
+            job.plan_data.spindle.hal->set_state(job.plan_data.spindle.hal, job.spindle, job.spindle.on ? job.needle_rpm : 0.0f);
     }
 
     return on;
 }
 
+// Returns number of queued stitches following the current one before the needle has to be stopped,
+// -1 if not within EMBROIDERY_RAMP_STITCHES. End of design counts as a stop.
+static int_fast16_t stitches_to_stop (void)
+{
+    int_fast16_t n = job.replay.len - job.replay.idx; // replayed stitches are all normal stitches
+    uint_fast16_t idx = job.queue.tail;
+
+    while(idx != QUEUE_LOAD(job.queue.head)) {
+        if(job.queue.stitch[idx].type != Stitch_Normal)
+            return n;
+        if(++n > EMBROIDERY_RAMP_STITCHES)
+            return -1;
+        idx = (idx + 1) & (STITCH_QUEUE_SIZE - 1);
+    }
+
+    return QUEUE_LOAD(job.enqueued) ? n : -1;
+}
+
+// Closed loop needle speed control, sync mode only.
+// Speed is limited by the longest of the next queued stitches so that its move completes within the needle up window.
+// The speed scale is reduced each time XY motion was not completed before the needle trigger (job.errs incremented)
+// and slowly restored when there are no errors.
+// Ahead of a stop speed is ramped down linearly, reaching EMBROIDERY_NEEDLE_RPM_MIN on the last stitch.
+static void needle_speed_control (int_fast16_t to_stop)
+{
+    float rpm, length = 0.0f;
+    uint_fast16_t idx = job.queue.tail, n = EMBROIDERY_SPEED_LOOKAHEAD;
+
+    while(idx != QUEUE_LOAD(job.queue.head) && n--) {
+        stitch_packed_t *stitch = &job.queue.stitch[idx];
+        if(stitch->type != Stitch_Normal)
+            break;
+        length = max(length, (float)((int32_t)stitch->x * stitch->x + (int32_t)stitch->y * stitch->y));
+        idx = (idx + 1) & (STITCH_QUEUE_SIZE - 1);
+    }
+
+    if(job.errs != job.speed_errs) {
+        job.speed_errs = job.errs;
+        job.speed_scale = max(job.speed_scale * 0.9f, 0.1f);
+    } else if(job.speed_scale < 1.0f)
+        job.speed_scale = min(job.speed_scale + 0.002f, 1.0f);
+
+    rpm = embroidery.needle_speed * job.speed_scale;
+
+    if(length > 0.0f) {
+        // move time in minutes, needle period has to be this divided by the move window
+        float t_move = sqrtf(length) / (10.0f * embroidery.feedrate);
+        rpm = min(rpm, (float)EMBROIDERY_MOVE_WINDOW / (100.0f * t_move));
+    }
+
+    if(to_stop >= 0 && to_stop < EMBROIDERY_RAMP_STITCHES && rpm > EMBROIDERY_NEEDLE_RPM_MIN)
+        rpm = EMBROIDERY_NEEDLE_RPM_MIN + (rpm - EMBROIDERY_NEEDLE_RPM_MIN) * (float)to_stop / (float)EMBROIDERY_RAMP_STITCHES;
+
+    rpm = max(rpm, EMBROIDERY_NEEDLE_RPM_MIN);
+
+    if(fabsf(rpm - job.needle_rpm) > job.needle_rpm * 0.01f) {
+        job.needle_rpm = rpm;
+        if(job.spindle.on)
+            job.plan_data.spindle.hal->set_state(job.plan_data.spindle.hal, job.spindle, job.needle_rpm);
+    }
+}
+
+static inline uint_fast16_t queue_fill (void)
+{
+    return (QUEUE_LOAD(job.queue.head) - QUEUE_LOAD(job.queue.tail)) & (STITCH_QUEUE_SIZE - 1);
+}
+
+// Returns true if a replayed or queued stitch is available for dispatch.
+static inline bool stitch_pending (void)
+{
+    return job.replay.idx < job.replay.len || job.queue.tail != QUEUE_LOAD(job.queue.head);
+}
+
+// Next stitch to be dispatched, stitch_pending() must be true.
+static inline stitch_packed_t *next_stitch (void)
+{
+    return job.replay.idx < job.replay.len ? &job.replay.stitch[job.replay.idx] : &job.queue.stitch[job.queue.tail];
+}
+
+#if EMBROIDERY_TRANSFORM
+
+static inline void transform_position (stitch_position_t *target, const stitch_position_t *pos)
+{
+    target->x = (int32_t)(((int64_t)transform.a * pos->x + (int64_t)transform.b * pos->y + 0x8000) >> 16) + transform.offset.x;
+    target->y = (int32_t)(((int64_t)transform.c * pos->x + (int64_t)transform.d * pos->y + 0x8000) >> 16) + transform.offset.y;
+}
+
+// Inject a zero length jump ahead of the decoded stitches, it is transformed to a rapid move to the design origin.
+// Without it the offset would be added to the first stitch. Not needed when resuming, the resume move is transformed.
+static void inject_origin_move (void)
+{
+    merge.stitch[0].type = Stitch_Jump;
+    merge.stitch[0].delta.x = merge.stitch[0].delta.y = 0;
+    merge.count = 1;
+    merge.idx = 0;
+    job.programmed.jumps++;
+}
+
+#endif
+
+// Accumulate stitch delta to the absolute (integer) position, convert to machine position for motion.
+// When a transform is active the absolute position is transformed, rounding errors are thus not accumulated,
+// and delta is replaced by the transformed move.
+static inline void add_delta (stitch_delta_t *delta)
+{
+    job.stitch_pos.x += delta->x;
+    job.stitch_pos.y += delta->y;
+
+#if EMBROIDERY_TRANSFORM
+    if(!transform.identity) {
+
+        stitch_position_t pos;
+
+        transform_position(&pos, &job.stitch_pos);
+
+        delta->x = (int16_t)(pos.x - job.transformed.x);
+        delta->y = (int16_t)(pos.y - job.transformed.y);
+        job.transformed = pos;
+        job.position.x = job.origin.x + (float)pos.x / 10.0f;
+        job.position.y = job.origin.y + (float)pos.y / 10.0f;
+        return;
+    }
+#endif
+
+    job.position.x = job.origin.x + (float)job.stitch_pos.x / 10.0f;
+    job.position.y = job.origin.y + (float)job.stitch_pos.y / 10.0f;
+}
+
+// Feedrate for completing the stitch move within the needle up window of the measured needle period.
+// The configured feedrate is used as the lower limit, the planner clamps to axis max rates.
+static float stitch_feedrate (stitch_delta_t *delta)
+{
+    float feed_rate = embroidery.feedrate;
+
+    if(job.spindle.on && trigger_stats.count) {
+
+        float length = sqrtf((float)((int32_t)delta->x * delta->x + (int32_t)delta->y * delta->y)) / 10.0f,
+              window = trigger_stats.period * (float)EMBROIDERY_MOVE_WINDOW / (100.0f * 60000000.0f); // minutes
+
+        feed_rate = max(feed_rate, length / window);
+    }
+
+    return feed_rate;
+}
+
+#if EMBROIDERY_DECODER_TASK
+
+static struct {
+    TaskHandle_t task;
+    volatile bool run;  // set by the grbl core while a job is active
+    volatile bool busy; // set by the decoder task while it may access the job
+} decoder;
+
+// Stop decoding and wait for the refill in progress to complete, at most EMBROIDERY_REFILL_BUDGET ms.
+static void decoder_stop (void)
+{
+    decoder.run = false;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while(decoder.busy);
+}
+
+#endif
+
 static void end_job (void)
 {
+#if EMBROIDERY_DECODER_TASK
+    decoder_stop();
+#endif
+
     job.completed = job.enqueued = true;
 
     if(active_stream.type != StreamType_Null) {
@@ -131,17 +539,31 @@ static void end_job (void)
         job.file = NULL;
     }
 
+    if(job.cache) {
+        vfs_close(job.cache);
+        job.cache = NULL;
+    }
+
     spindle_control(Off);
 }
 
+// Operator messages, shared by the blocking and asynchronous trim and thread change paths.
+static void report_operation (void *message)
+{
+    report_message((const char *)message, Message_Info);
+}
+
+static inline const char *operation_message (stich_type_t op, embroidery_thread_color_t color)
+{
+    return op == Stitch_Trim ? "trim" : api.get_thread_color(color);
+}
+
 // Start a tool change sequence. Called by gcode.c on a M6 command (via HAL).
 static void thread_change (embroidery_thread_color_t color)
 {
-    const char *thread_color = api.get_thread_color(color);
-
     spindle_control(Off);
 
-    report_message(thread_color, Message_Info);
+    report_operation((void *)operation_message(Stitch_Stop, color));
     protocol_buffer_synchronize();              // Sync and finish all remaining buffered motions before moving on.
     system_set_exec_state_flag(EXEC_FEED_HOLD); // Use feed hold for program pause.
     protocol_execute_realtime();                // Execute suspend.
@@ -158,7 +580,7 @@ static void thread_trim (void)
 {
     spindle_control(Off);
 
-    report_message("trim", Message_Info);
+    report_operation((void *)operation_message(Stitch_Trim, 0));
     protocol_buffer_synchronize();              // Sync and finish all remaining buffered motions before moving on.
     system_set_exec_state_flag(EXEC_FEED_HOLD); // Use feed hold for program pause.
     protocol_execute_realtime();                // Execute suspend.
@@ -171,6 +593,161 @@ static void exec_thread_trim (void *data)
     api.thread_trim();
 }
 
+static void report_out_of_range (void *data)
+{
+    report_message("Stitch out of range, job aborted", Message_Warning);
+}
+
+// Run pending asynchronous trim or thread change when motion has completed, resume job on completion.
+static void process_operation (void)
+{
+    if(!job.op_started) {
+
+        if(job.machine_state != STATE_IDLE || plan_get_current_block())
+            return;
+
+        embroidery_op_status_t status;
+
+        spindle_control(Off);
+        job.spindle_stop = 0;
+        job.op_started = true;
+        job.op_status = EmbroideryOp_InProgress; // completion may be signalled before the handler returns
+
+        protocol_enqueue_foreground_task(report_operation, (void *)operation_message(job.op, job.color));
+
+        if((status = job.op == Stitch_Trim ? api.thread_trim_async() : api.thread_change_async(job.color)) != EmbroideryOp_InProgress)
+            job.op_status = status;
+    }
+
+    if(job.op_status == EmbroideryOp_InProgress)
+        return;
+
+    if(job.op == Stitch_Trim)
+        job.executed.trims++;
+    else
+        job.executed.thread_changes++;
+
+    if(job.op_status == EmbroideryOp_Failed)
+        system_set_exec_state_flag(EXEC_FEED_HOLD); // job is resumed by cycle start
+    else
+        job.paused = false;
+
+    job.op = Stitch_Normal;
+}
+
+// Back up the needle by the stitches sewn since the thread broke, at most the back-track setting,
+// and wait for cycle start. The stitches backed up over are sewn again ahead of the queued stitches.
+static void exec_thread_break (void *data)
+{
+    uint_fast8_t n = 0, idx, remaining = job.replay.len - job.replay.idx;
+    stitch_delta_t back = {0};
+    stitch_packed_t *stitch;
+
+    protocol_buffer_synchronize();  // Sync and finish all remaining buffered motions before moving on.
+
+    // Find the number of stitches that can be backed up over with a single packed move, idx is left at the oldest.
+    idx = job.history.head;
+    while(n < job.history.count) {
+        stitch = &job.history.stitch[idx ? idx - 1 : EMBROIDERY_BACKTRACK - 1];
+        if(abs(back.x - stitch->x) > STITCH_PACKED_MAX || abs(back.y - stitch->y) > STITCH_PACKED_MAX)
+            break;
+        back.x -= stitch->x;
+        back.y -= stitch->y;
+        idx = idx ? idx - 1 : EMBROIDERY_BACKTRACK - 1;
+        n++;
+    }
+
+    // Prepend the stitches to any replay not yet completed.
+    memmove(&job.replay.stitch[n], &job.replay.stitch[job.replay.idx], remaining * sizeof(stitch_packed_t));
+    for(job.replay.len = 0; job.replay.len < n; job.replay.len++) {
+        job.replay.stitch[job.replay.len] = job.history.stitch[idx];
+        idx = idx == EMBROIDERY_BACKTRACK - 1 ? 0 : idx + 1;
+    }
+    job.replay.idx = 0;
+    job.replay.len += remaining;
+    job.history.count = 0;
+
+    job.exced -= n;
+    job.backtracked += n;
+    job.thread_breaks++;
+    job.await_trigger = false; // needle is restarted by the first replayed stitch
+
+    report_message("Thread break, rethread and cycle start to resume", Message_Warning);
+
+    if(n) {
+        job.plan_data.condition.rapid_motion = On;
+        add_delta(&back);
+        mc_line(job.position.values, &job.plan_data);
+        protocol_buffer_synchronize();
+    }
+
+    system_set_exec_state_flag(EXEC_FEED_HOLD); // Use feed hold for program pause.
+    protocol_execute_realtime();                // Execute suspend.
+}
+
+static void add_details (embroidery_job_details_t *total, embroidery_job_details_t *details)
+{
+    total->stitches += details->stitches;
+    total->jumps += details->jumps;
+    total->trims += details->trims;
+    total->thread_changes += details->thread_changes;
+    total->sequin_ejects += details->sequin_ejects;
+}
+
+// Piece completed, move to the origin of the next piece and pause for hoop change.
+// The decoder is restarted from the start of the stitch data, the file is not reopened.
+static void exec_next_piece (void *data)
+{
+    protocol_buffer_synchronize();  // Sync and finish all remaining buffered motions before moving on.
+
+    add_details(&repeat.executed, &job.executed);
+    memset(&job.programmed, 0, sizeof(embroidery_job_details_t));
+    memset(&job.executed, 0, sizeof(embroidery_job_details_t));
+    memset(&job.merged, 0, sizeof(embroidery_job_details_t));
+    job.exced = 0;
+    repeat.piece++;
+
+    job.origin.x += repeat.step.x;
+    job.origin.y += repeat.step.y;
+    job.position.x = job.origin.x;
+    job.position.y = job.origin.y;
+    job.stitch_pos.x = job.stitch_pos.y = 0;
+#if EMBROIDERY_TRANSFORM
+    // Start from the transformed design origin, the offset is then taken by the rapid move below.
+    transform_position(&job.transformed, &job.stitch_pos);
+    job.position.x += (float)job.transformed.x / 10.0f;
+    job.position.y += (float)job.transformed.y / 10.0f;
+#endif
+    job.history.count = job.replay.idx = job.replay.len = 0;
+    job.plan_data.condition.rapid_motion = On;
+    mc_line(job.position.values, &job.plan_data);
+
+    report_message("Piece completed, change hoop", Message_Info);
+
+    if(stitch_reader_seek(&reader, repeat.offset)) {
+
+        api.set_state(repeat.state);
+        batch.idx = batch.len = 0;
+        batch.eof = false;
+        memset(&merge, 0, sizeof(stitch_merge_t));
+        memset(&optimizer, 0, sizeof(stitch_optimizer_t)); // counters are per piece as the other statistics
+        QUEUE_STORE(job.enqueued, false);
+#if EMBROIDERY_DECODER_TASK
+        xTaskNotifyGive(decoder.task);
+#endif
+    } else
+        repeat.pieces = repeat.piece; // read error, end job
+
+    if(repeat.pause > 0.0f) {
+        mc_dwell(repeat.pause);
+        job.paused = false;
+    } else {
+        protocol_buffer_synchronize();
+        system_set_exec_state_flag(EXEC_FEED_HOLD); // Use feed hold for program pause.
+        protocol_execute_realtime();                // Execute suspend.
+    }
+}
+
 static void exec_hold (void *data)
 {
     spindle_control(Off);
@@ -193,6 +770,8 @@ static void onStateChanged (sys_state_t state)
 
         case STATE_IDLE:
             if(job.stitching && job.machine_state == STATE_CYCLE) {
+                if(!job.await_trigger && !job.paused && !job.completed)
+                    job.planner_starved++;
 //                if(job.first)
 //                    job.first = false;
  //               else {
@@ -219,9 +798,58 @@ static void onStateChanged (sys_state_t state)
         on_state_change(state);
 }
 
+static uint32_t get_micros_ms (void)
+{
+    return hal.get_elapsed_ticks() * 1000;
+}
+
+// Consume trigger timestamps captured by the interrupt handler and update period statistics.
+static void process_triggers (void)
+{
+    uint32_t period, deviation;
+    uint_fast8_t bin;
+
+    while(triggers.tail != triggers.head) {
+
+        uint32_t us = triggers.us[triggers.tail];
+
+        triggers.tail = (triggers.tail + 1) & (EMBROIDERY_TRIGGER_RING - 1);
+
+        if(trigger_stats.last && (period = us - trigger_stats.last) < TRIGGER_TIMEOUT) {
+
+            if(trigger_stats.count++ == 0) {
+                trigger_stats.period = (float)period;
+                trigger_stats.period_min = trigger_stats.period_max = period;
+            } else {
+
+                deviation = (uint32_t)fabsf((float)period - trigger_stats.period);
+
+                trigger_stats.period += ((float)period - trigger_stats.period) * 0.125f;
+                trigger_stats.jitter += ((float)deviation - trigger_stats.jitter) * 0.125f;
+                trigger_stats.period_min = min(trigger_stats.period_min, period);
+                trigger_stats.period_max = max(trigger_stats.period_max, period);
+
+                deviation = (uint32_t)((float)deviation * 100.0f / trigger_stats.period);
+                for(bin = 0; bin < TRIGGER_HISTOGRAM_BINS - 1 && deviation >= (1UL << bin); bin++);
+                trigger_stats.histogram[bin]++;
+            }
+        }
+
+        trigger_stats.last = us;
+    }
+}
+
 static inline void set_needle_trigger (void)
 {
     uint32_t ms = hal.get_elapsed_ticks();
+    uint_fast8_t head = (triggers.head + 1) & (EMBROIDERY_TRIGGER_RING - 1);
+
+    if(head == triggers.tail)
+        triggers.overruns++;
+    else {
+        triggers.us[triggers.head] = get_micros();
+        triggers.head = head;
+    }
 
     if(job.await_trigger /*&& ms - job.last_trigger > 25*/) {
 
@@ -256,56 +884,59 @@ ISR_CODE static void ISR_FUNC(needle_trigger)(uint8_t port, bool state)
     set_needle_trigger();
 }
 
-static void onExecuteRealtime (sys_state_t state)
+// Only breaks while stitching are acted upon, the thread is expected to be slack or cut otherwise.
+ISR_CODE static void ISR_FUNC(thread_break)(uint8_t port, bool state)
 {
-    static bool busy = false;
-
-    on_execute_realtime(state);
-
-    if(busy || job.completed)
-        return;
-
-    if(job.spindle_stop && hal.get_elapsed_ticks() - job.last_trigger >= job.spindle_stop) {
-        spindle_control(Off);
-        job.spindle_stop = 0;
-    }
+    if(job.stitching && !job.completed)
+        job.thread_break = true;
+}
 
-    if(job.paused || job.await_trigger)
-        return;
+// Rotary needle axis, re-zero Z to the job origin when motion has stopped so that the axis position stays bounded.
+// The needle is then at the same angle as at job start since each stitch is one full revolution.
+static bool needle_rezero (void)
+{
+    if(job.machine_state != STATE_IDLE || plan_get_current_block())
+        return false;
 
-    if(job.enqueued && job.queue.tail == job.queue.head) {
+    float steps_per_mm = settings.axis[Z_AXIS].steps_per_mm;
 
-        end_job();
-        hal.stream.cancel_read_buffer();
+    sys.position[Z_AXIS] -= lroundf((job.origin.z + (float)job.needle_turns * embroidery.z_travel) * steps_per_mm) -
+                             lroundf(job.origin.z * steps_per_mm);
+    plan_sync_position();
+    job.needle_turns = 0;
 
-        if(grbl.on_program_completed)
-            grbl.on_program_completed(ProgramFlow_CompletedM30, false);
+    return true;
+}
 
-        grbl.report.feedback_message(Message_ProgramEnd);
+// Dispatch the next replayed stitch or the stitch at the tail of the queue to the planner.
+static void dispatch_stitch (void)
+{
+    stitch_t unpacked, *stitch = &unpacked;
+    stitch_packed_t packed;
+    bool was_stitching = job.stitching;
 
-        return;
+    if(job.replay.idx < job.replay.len)
+        packed = job.replay.stitch[job.replay.idx++];
+    else {
+        packed = job.queue.stitch[job.queue.tail];
+        QUEUE_STORE(job.queue.tail, (job.queue.tail + 1) & (STITCH_QUEUE_SIZE - 1));
     }
 
-    if(plan_get_block_buffer_available() < 3)
-        return;
-
-    stitch_t *stitch = &job.queue.stitch[job.queue.tail];
-
-    // Wait for non-stitching moves to complete before starting stitching
-    if(!job.stitching && stitch->type == Stitch_Normal && job.machine_state != STATE_IDLE)
-        return;
-
-    bool was_stitching = job.stitching;
+    stitch_unpack(stitch, packed);
 
-    busy = true;
+    if(stitch->type == Stitch_Normal) {
+        job.history.stitch[job.history.head] = packed;
+        job.history.head = job.history.head == EMBROIDERY_BACKTRACK - 1 ? 0 : job.history.head + 1;
+        if(job.history.count < embroidery.backtrack)
+            job.history.count++;
+    } else
+        job.history.count = 0;
 
-    job.queue.tail = ++job.queue.tail & (STITCH_QUEUE_SIZE - 1);
+    int_fast16_t to_stop = stitches_to_stop();
 
-    // If stitching look-ahead to next command to see if we should stop the motor early to avoid overshoot.
-    if(job.stitching) {
-        if(job.queue.tail != job.queue.head && job.queue.stitch[job.queue.tail].type != Stitch_Normal && embroidery.stop_delay)
-            job.spindle_stop = embroidery.stop_delay;
-    }
+    // If stitching look-ahead to see if we should stop the motor early to avoid overshoot.
+    if(job.stitching && to_stop == 0 && embroidery.stop_delay)
+        job.spindle_stop = embroidery.stop_delay;
 
     if(!(job.stitching = stitch->type == Stitch_Normal) && embroidery.stop_delay == 0) {
         spindle_control(Off);
@@ -318,15 +949,31 @@ static void onExecuteRealtime (sys_state_t state)
             job.exced++;
             job.plan_data.condition.rapid_motion = Off;
 
-            job.position.x += stitch->target.x;
-            job.position.y += stitch->target.y;
+            add_delta(&stitch->delta);
+
+            if(embroidery.sync_mode && embroidery.needle_speed > 0.0f)
+                needle_speed_control(to_stop);
 
             if((job.first = !job.spindle.on))
                 spindle_control(On);
 
+            if(embroidery.sync_mode && embroidery.options.adaptive_feed)
+                job.plan_data.feed_rate = stitch_feedrate(&stitch->delta);
+
+            if(!(job.await_trigger = embroidery.sync_mode) && embroidery.options.rotary_needle) {
+                // Z is a continuously rotating needle drive, z_travel per stitch. XY moves with the needle up
+                // phase (first half turn), then the needle is stroked with XY stationary.
+                // Z position is derived from the turn count to avoid accumulating float errors.
+                job.position.z = job.origin.z + (float)job.needle_turns * embroidery.z_travel + embroidery.z_travel * 0.5f;
+                mc_line(job.position.values, &job.plan_data);
+                job.position.z = job.origin.z + (float)(++job.needle_turns) * embroidery.z_travel;
+                mc_line(job.position.values, &job.plan_data);
+                break;
+            }
+
             mc_line(job.position.values, &job.plan_data);
 
-            if(!(job.await_trigger = embroidery.sync_mode)) {
+            if(!job.await_trigger) {
 //                plan_data.condition.rapid_motion = On;
                 job.position.z = -embroidery.z_travel;
                 mc_line(job.position.values, &job.plan_data);
@@ -339,14 +986,18 @@ static void onExecuteRealtime (sys_state_t state)
             job.executed.jumps++;
             job.plan_data.condition.rapid_motion = On;
 
-            job.position.x += stitch->target.x;
-            job.position.y += stitch->target.y;
+            add_delta(&stitch->delta);
 
-            if(was_stitching) {
+            if(was_stitching && embroidery.jump_mode == EmbroideryJump_Hold) {
                 job.paused = true;
                 protocol_enqueue_foreground_task(exec_hold, NULL);
-            } else
+            } else {
+                if(was_stitching) {
+                    spindle_control(Off);
+                    job.spindle_stop = 0;
+                }
                 mc_line(job.position.values, &job.plan_data);
+            }
             break;
 
         case Stitch_Trim:
@@ -354,23 +1005,29 @@ static void onExecuteRealtime (sys_state_t state)
             job.plan_data.condition.rapid_motion = On;
             job.spindle_stop = embroidery.stop_delay;
 
-            job.position.x += stitch->target.x;
-            job.position.y += stitch->target.y;
+            add_delta(&stitch->delta);
             mc_line(job.position.values, &job.plan_data);
 
-            protocol_enqueue_foreground_task(exec_thread_trim, NULL);
+            if(api.thread_trim_async) {
+                job.op = Stitch_Trim;
+                job.op_started = false;
+            } else
+                protocol_enqueue_foreground_task(exec_thread_trim, NULL);
             break;
 
         case Stitch_Stop:
             job.paused = true;
             job.plan_data.condition.rapid_motion = On;
 
-            job.position.x += stitch->target.x;
-            job.position.y += stitch->target.y;
+            add_delta(&stitch->delta);
 //            mc_line(job.position.values, &job.plan_data);
 
             job.color = stitch->color;
-            protocol_enqueue_foreground_task(exec_thread_change, NULL);
+            if(api.thread_change_async) {
+                job.op = Stitch_Stop;
+                job.op_started = false;
+            } else
+                protocol_enqueue_foreground_task(exec_thread_change, NULL);
             job.spindle_stop = embroidery.stop_delay;
             break;
 
@@ -379,59 +1036,386 @@ static void onExecuteRealtime (sys_state_t state)
             break;
     }
 
-    busy = false;
 }
 
-static int16_t sdcard_read (void)
+static void onExecuteRealtime (sys_state_t state)
 {
-    if(!job.enqueued) {
-
-        uint_fast8_t bptr = (job.queue.head + 1) & (STITCH_QUEUE_SIZE - 1);
-
-        if(bptr != job.queue.tail) {
-            if(!(job.enqueued = !api.get_stitch(&job.queue.stitch[job.queue.head], job.file))) {
-
-                switch(job.queue.stitch[job.queue.head].type) {
-                    case Stitch_Normal:
-                        job.programmed.stitches++;
-                        break;
+    static bool busy = false;
 
-                    case Stitch_Jump:
-                        job.programmed.jumps++;
-                        break;
+    on_execute_realtime(state);
 
-                    case Stitch_Trim:
-                        job.programmed.trims++;
-                        break;
+    if(busy || job.completed)
+        return;
 
-                    case Stitch_Stop:
-                        job.programmed.thread_changes++;
-                        break;
+    process_triggers();
 
-                    case Stitch_SequinEject:
-                        job.programmed.sequin_ejects++;
-                        break;
-                }
+    if(job.spindle_stop && hal.get_elapsed_ticks() - job.last_trigger >= job.spindle_stop) {
+        spindle_control(Off);
+        job.spindle_stop = 0;
+    }
 
-                job.queue.head = bptr;
-            }
+    if(job.op != Stitch_Normal)
+        process_operation();
+
+    if(job.thread_break) {
+        job.thread_break = job.stitching = false; // further breaks are ignored until stitching is resumed
+        job.paused = true;
+        spindle_control(Off);
+        job.spindle_stop = 0;
+        protocol_enqueue_foreground_task(exec_thread_break, NULL);
+    }
+
+    if(job.paused || job.await_trigger)
+        return;
+
+    if(QUEUE_LOAD(job.enqueued) && !stitch_pending()) {
+
+        if(repeat.piece + 1 < repeat.pieces && !job.out_of_range) {
+            job.paused = true;
+            job.stitching = false;
+            spindle_control(Off);
+            job.spindle_stop = 0;
+            protocol_enqueue_foreground_task(exec_next_piece, NULL);
+            return;
         }
+
+        end_job();
+
+        if(job.out_of_range)
+            protocol_enqueue_foreground_task(report_out_of_range, NULL);
+        hal.stream.cancel_read_buffer();
+
+        if(grbl.on_program_completed)
+            grbl.on_program_completed(ProgramFlow_CompletedM30, false);
+
+        grbl.report.feedback_message(Message_ProgramEnd);
+
+        return;
     }
 
-    return SERIAL_NO_DATA;
+    if(!stitch_pending()) {
+        if(job.stitching && !job.starving) {
+            job.starving = true;
+            job.queue_empty++;
+        }
+        return;
+    }
+
+    job.starving = false;
+
+    uint_fast8_t blocks = embroidery.sync_mode ? 1 : (embroidery.options.rotary_needle ? 2 : 3);
+    uint_fast8_t dispatched = 0;
+
+    busy = true;
+
+    // Without sync consecutive stitches are dispatched while there is room in the planner buffer,
+    // stops at trigger waits, trims, jumps and stops.
+    do {
+
+        uint_fast16_t available = plan_get_block_buffer_available();
+
+        if(available < blocks)
+            break;
+
+        // With the thread break monitor enabled stitches planned are limited to the back-track count, on a break
+        // the needle is then backed up over all stitches moved after the needle was stopped.
+        job.planner_blocks = max(job.planner_blocks, available);
+        if(break_port != 0xFF && job.planner_blocks - available > (embroidery.backtrack - 1) * blocks)
+            break;
+
+        // Rotary needle, wait for motion to stop for re-zeroing Z when the max number of revolutions is reached
+        if(job.needle_turns >= EMBROIDERY_NEEDLE_WRAP && !needle_rezero())
+            break;
+
+        // Wait for non-stitching moves to complete before starting stitching
+        if(!job.stitching && next_stitch()->type == Stitch_Normal && job.machine_state != STATE_IDLE)
+            break;
+
+        PROFILE_START(t_start);
+
+        dispatch_stitch();
+
+        PROFILE_END(Profile_Dispatch, t_start, job.decoded - queue_fill() - 1);
+
+    } while(++dispatched < EMBROIDERY_DISPATCH_MAX && job.stitching && !(job.paused || job.await_trigger) &&
+             stitch_pending() && next_stitch()->type == Stitch_Normal);
+
+#if EMBROIDERY_DECODER_TASK
+    if(dispatched)
+        xTaskNotifyGive(decoder.task); // room in queue, wake up decoder
+#endif
+
+    busy = false;
+}
+
+static void count_stitch (embroidery_job_details_t *details, stich_type_t type)
+{
+    switch(type) {
+
+        case Stitch_Normal:
+            details->stitches++;
+            break;
+
+        case Stitch_Jump:
+            details->jumps++;
+            break;
+
+        case Stitch_Trim:
+            details->trims++;
+            break;
+
+        case Stitch_Stop:
+            details->thread_changes++;
+            break;
+
+        case Stitch_SequinEject:
+            details->sequin_ejects++;
+            break;
+    }
+}
+
+// Get next stitch from reader, via batch decode if supported.
+static bool decode_stitch (stitch_t *stitch)
+{
+    PROFILE_START(t_start);
+
+    if(api.get_stitches == NULL) {
+        if(!api.get_stitch(stitch, &reader))
+            return false;
+    } else {
+
+        if(batch.idx == batch.len) {
+            if(batch.eof)
+                return false;
+            batch.idx = 0;
+            batch.eof = (batch.len = api.get_stitches(batch.stitch, EMBROIDERY_DECODE_BATCH, &reader)) < EMBROIDERY_DECODE_BATCH;
+            if(batch.len == 0)
+                return false;
+        }
+
+        memcpy(stitch, &batch.stitch[batch.idx++], sizeof(stitch_t));
+    }
+
+    PROFILE_END(Profile_Decode, t_start, job.decoded);
+
+    count_stitch(&job.programmed, stitch->type);
+
+    return true;
+}
+
+// Pipeline stage: merge chains of jumps to a single jump. In EmbroideryJump_MergeTrims mode the move of a trim
+// is merged into the following jumps so that the thread is trimmed in place before a single rapid move.
+// Jumps absorbed are counted in job.merged, programmed = executed + merged.
+static bool merge_jumps (stitch_t *stitch)
+{
+    if(merge.idx < merge.count) {
+        memcpy(stitch, &merge.stitch[merge.idx++], sizeof(stitch_t));
+        if(stitch->type == Stitch_Jump) // merged jump, the record following it may be a trim to merge
+            return true;
+    } else if(resume.move.x || resume.move.y) {
+        // Move to the resume position, injected as jumps that fit a packed stitch.
+        stitch->type = Stitch_Jump;
+        stitch->delta.x = (int16_t)max(-STITCH_PACKED_MAX, min(resume.move.x, STITCH_PACKED_MAX));
+        stitch->delta.y = (int16_t)max(-STITCH_PACKED_MAX, min(resume.move.y, STITCH_PACKED_MAX));
+        resume.move.x -= stitch->delta.x;
+        resume.move.y -= stitch->delta.y;
+        job.programmed.jumps++;
+        return true;
+    } else if(merge.eof || !decode_stitch(stitch))
+        return false;
+
+    if(embroidery.jump_mode >= EmbroideryJump_Merge && (stitch->type == Stitch_Jump || (stitch->type == Stitch_Trim && embroidery.jump_mode == EmbroideryJump_MergeTrims))) {
+
+        bool trim = stitch->type == Stitch_Trim;
+        uint_fast16_t n = 0;
+        stitch_t *jump = stitch, *next;
+
+        merge.idx = merge.count = 0;
+
+        if(trim) {
+            memcpy(&merge.stitch[merge.count++], stitch, sizeof(stitch_t));
+            jump = &merge.stitch[0];
+            jump->type = Stitch_Jump;
+        }
+
+        next = &merge.stitch[merge.count];
+
+        while(!(merge.eof = !decode_stitch(next)) && next->type == Stitch_Jump &&
+               abs(jump->delta.x + next->delta.x) <= STITCH_PACKED_MAX && abs(jump->delta.y + next->delta.y) <= STITCH_PACKED_MAX) {
+            jump->delta.x += next->delta.x;
+            jump->delta.y += next->delta.y;
+            if(n++ || !trim)
+                job.merged.jumps++;
+        }
+
+        if(!merge.eof)
+            merge.count++;
+
+        if(trim) {
+            if(n == 0) { // nothing to merge, restore
+                memcpy(&stitch->delta, &merge.stitch[0].delta, sizeof(stitch_delta_t));
+                if(--merge.count)
+                    memcpy(&merge.stitch[0], &merge.stitch[1], sizeof(stitch_t));
+            } else
+                stitch->delta.x = stitch->delta.y = 0;
+        }
+    }
+
+    // A stop with both motion and a thread color does not fit a packed stitch, the motion is split off as a jump.
+    if(stitch->type == Stitch_Stop && stitch->color && (stitch->delta.x || stitch->delta.y)) {
+        memcpy(&merge.stitch[0], stitch, sizeof(stitch_t));
+        merge.stitch[0].delta.x = merge.stitch[0].delta.y = 0;
+        merge.idx = 0;
+        merge.count = 1;
+        stitch->type = Stitch_Jump;
+        job.programmed.jumps++;
+    }
+
+    return true;
+}
+
+static inline int32_t length_sq (stitch_delta_t *delta)
+{
+    return (int32_t)delta->x * delta->x + (int32_t)delta->y * delta->y;
+}
+
+// Pipeline stage: stitches shorter than EMBROIDERY_MIN_STITCH are merged into the following stitch
+// and runs of collinear stitches are combined up to EMBROIDERY_MAX_STITCH length.
+// Removed stitches are counted in the optimizer, programmed = executed + merged + optimized.
+static bool optimize_stitches (stitch_t *stitch)
+{
+    stitch_t next;
+    stitch_delta_t sum;
+
+    if(optimizer.held) {
+        memcpy(stitch, &optimizer.next, sizeof(stitch_t));
+        optimizer.held = false;
+    } else if(!merge_jumps(stitch))
+        return false;
+
+    if(!embroidery.options.optimize || stitch->type != Stitch_Normal)
+        return true;
+
+    while(merge_jumps(&next)) {
+
+        bool micro, collinear;
+
+        sum.x = stitch->delta.x + next.delta.x;
+        sum.y = stitch->delta.y + next.delta.y;
+
+        micro = length_sq(&stitch->delta) < EMBROIDERY_MIN_STITCH * EMBROIDERY_MIN_STITCH ||
+                 length_sq(&next.delta) < EMBROIDERY_MIN_STITCH * EMBROIDERY_MIN_STITCH;
+        collinear = (int32_t)stitch->delta.x * next.delta.y == (int32_t)stitch->delta.y * next.delta.x &&
+                     (int32_t)stitch->delta.x * next.delta.x + (int32_t)stitch->delta.y * next.delta.y > 0 &&
+                      length_sq(&sum) <= EMBROIDERY_MAX_STITCH * EMBROIDERY_MAX_STITCH;
+
+        if(next.type != Stitch_Normal || !(micro || collinear) || abs(sum.x) > STITCH_PACKED_MAX || abs(sum.y) > STITCH_PACKED_MAX) {
+            memcpy(&optimizer.next, &next, sizeof(stitch_t));
+            optimizer.held = true;
+            break;
+        }
+
+        memcpy(&stitch->delta, &sum, sizeof(stitch_delta_t));
+
+        if(micro)
+            optimizer.micro++;
+        else
+            optimizer.collinear++;
+    }
+
+    return true;
 }
 
-static const char *trim (const char *s)
+#if EMBROIDERY_PREFETCH && !EMBROIDERY_DECODER_TASK
+
+// Foreground task, the block is read outside of the stream read callback so that it never waits for FatFs.
+static void prefetch_block (void *data)
 {
-    char *s1 = strrchr(s, '\0');
+    job.prefetching = false;
 
-    while(*(--s1) == '0')
-        *s1 = '\0';
+    if(!QUEUE_LOAD(job.enqueued))
+        stitch_reader_prefetch(&reader);
+}
 
-    if(*s1 == '.')
-        *s1 = '\0';
+#endif
 
-    return s;
+// Top up the stitch queue, decodes until full or the time budget is spent.
+static void refill_queue (void)
+{
+    if(!QUEUE_LOAD(job.enqueued)) {
+
+        stitch_t stitch;
+        uint32_t ms = hal.get_elapsed_ticks(), us = get_micros();
+        uint_fast16_t bptr = (job.queue.head + 1) & (STITCH_QUEUE_SIZE - 1);
+
+        while(bptr != QUEUE_LOAD(job.queue.tail)) {
+
+            PROFILE_START(t_start);
+
+            if(!optimize_stitches(&stitch)) {
+                QUEUE_STORE(job.enqueued, true);
+                break;
+            }
+
+            if(!stitch_pack(&job.queue.stitch[job.queue.head], &stitch)) {
+                job.out_of_range = true;
+                QUEUE_STORE(job.enqueued, true);
+                break;
+            }
+
+            QUEUE_STORE(job.queue.head, bptr);
+
+            PROFILE_END(Profile_Enqueue, t_start, job.decoded);
+
+            job.decoded++;
+            bptr = (bptr + 1) & (STITCH_QUEUE_SIZE - 1);
+
+            if(hal.get_elapsed_ticks() - ms >= EMBROIDERY_REFILL_BUDGET)
+                break;
+        }
+
+        job.decode_us += get_micros() - us;
+
+        // Queue is full, use the spare time to read the next block so that decoding does not wait for the SD card.
+        if(!QUEUE_LOAD(job.enqueued) && bptr == QUEUE_LOAD(job.queue.tail)) {
+#if EMBROIDERY_DECODER_TASK
+            stitch_reader_prefetch(&reader);
+#elif EMBROIDERY_PREFETCH
+            if(!(job.prefetching || reader.prefetched))
+                job.prefetching = protocol_enqueue_foreground_task(prefetch_block, NULL);
+#endif
+        }
+    }
+}
+
+#if EMBROIDERY_DECODER_TASK
+
+// Decoder task, runs on the core not running grbl. The grbl core only dispatches stitches and handles triggers.
+static void decoder_task (void *arg)
+{
+    for(;;) {
+
+        decoder.busy = true;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if(decoder.run)
+            refill_queue();
+
+        decoder.busy = false;
+
+        ulTaskNotifyTake(pdTRUE, 1);
+    }
+}
+
+#endif
+
+static int16_t sdcard_read (void)
+{
+#if !EMBROIDERY_DECODER_TASK
+    refill_queue();
+#endif
+
+    return SERIAL_NO_DATA;
 }
 
 static spindle_data_t *spindleGetData (spindle_data_request_t request)
@@ -439,19 +1423,277 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
     static spindle_data_t spindle_data = {0};
 
     if(request == SpindleData_RPM)
-        spindle_data.rpm = job.spindle.on ? 60000.0f / (float)job.trigger_interval : 0.0f;
+        spindle_data.rpm = job.spindle.on && trigger_stats.count ? 60000000.0f / trigger_stats.period : 0.0f;
 
     return &spindle_data;
 }
 
+// Position decoder at the requested stitch or color block and queue a rapid move to it.
+// The job origin is assumed to be the design origin.
+static status_code_t resume_job (void)
+{
+    uint_fast16_t idx;
+    embroidery_checkpoint_t cp;
+
+    resume.pending = false;
+
+    if(resume.block) {
+        if(resume.value >= design_index.n_blocks)
+            return Status_GcodeValueOutOfRange;
+        memcpy(&cp, &design_index.block[resume.value], sizeof(embroidery_checkpoint_t));
+        if(!stitch_reader_seek(&reader, cp.offset))
+            return Status_SDReadError;
+        api.set_state(cp.state);
+    } else if(!embroidery_seek(&reader, &api, &design_index, resume.value, &cp))
+        return resume.value > design_index.records ? Status_GcodeValueOutOfRange : Status_SDReadError;
+
+    // A color block starts with its Stop record, resuming within a block injects the thread change for it.
+    // Not for the block at start of data of formats with no initial Stop record.
+    if(!resume.block) {
+
+        for(idx = design_index.n_blocks; idx > 1 && design_index.block[idx - 1].stitch > cp.stitch; idx--);
+
+        if(idx && design_index.block[idx - 1].stitch < cp.stitch && (design_index.block[idx - 1].stitch || design_index.block[idx - 1].color)) {
+            merge.stitch[0].type = Stitch_Stop;
+            merge.stitch[0].color = cp.color;
+            merge.stitch[0].delta.x = merge.stitch[0].delta.y = 0;
+            merge.count = 1;
+            merge.idx = 0;
+            job.programmed.thread_changes++;
+        }
+    }
+
+    // The move to the resume position follows, ahead of the decoded stitches.
+    memcpy(&resume.move, &cp.position, sizeof(stitch_position_t));
+
+    report_message(resume.block ? "Resuming at color block" : "Resuming at stitch", Message_Info);
+
+    return Status_OK;
+}
+
+// Format handlers, selected by file extension and verified by the magic bytes at the start of the file.
+static const embroidery_format_t formats[] = {
+    { ".PES", "#PES", 4, brother_open_file },
+    { ".DST", "LA:", 3, tajima_open_file },
+    { ".EMC", "EMBC", 4, native_open_file }
+};
+
+static const embroidery_format_t *get_format (const char *fname)
+{
+    char ext[8], *s;
+    uint_fast8_t idx;
+
+    if((s = strrchr(fname, '.')) == NULL || strlen(s) >= sizeof(ext))
+        return NULL;
+
+    strcaps(strcpy(ext, s));
+
+    for(idx = 0; idx < sizeof(formats) / sizeof(embroidery_format_t); idx++) {
+        if(!strcmp(ext, formats[idx].extension))
+            return &formats[idx];
+    }
+
+    return NULL;
+}
+
+static bool open_file (const char *fname, vfs_file_t *file)
+{
+    bool ok = false;
+    const embroidery_format_t *format;
+    thread_trim_ptr thread_trim = api.thread_trim;
+    thread_change_ptr thread_change = api.thread_change;
+    thread_trim_async_ptr thread_trim_async = api.thread_trim_async;
+    thread_change_async_ptr thread_change_async = api.thread_change_async;
+
+    if((format = get_format(fname)) == NULL)
+        return false;
+
+    memset(&api, 0, sizeof(embroidery_t));
+    api.thread_trim = thread_trim;
+    api.thread_change = thread_change;
+    api.thread_trim_async = thread_trim_async;
+    api.thread_change_async = thread_change_async;
+    design_index.valid = design_native = false;
+
+    // A single read fills the reader buffer, the decoder parses its header from it.
+    if(stitch_reader_open(&reader, file) && stitch_reader_fill(&reader) != -1) {
+
+        reader.pos = 0;
+
+        if(reader.len >= format->magic_len && !memcmp(reader.data, format->magic, format->magic_len) && format->open(&reader, &api)) {
+            design_native = format->open == native_open_file;
+            ok = true;
+        }
+    }
+
+    if(!ok)
+        vfs_seek(file, 0); // the reader has read ahead, rewind for the next handler
+
+    return ok;
+}
+
+// Switch to the native format cache of the design if it is current, else pre-scan the design and create the cache.
+// Cache files are named as the source with the .emc extension appended.
+// file is left open, *native is set to the cache handle when the reader is switched to it. It is to be closed by the caller.
+// Returns true if the design index is loaded.
+static bool open_cache (const char *fname, vfs_file_t *file, vfs_file_t **native)
+{
+    char path[128];
+    vfs_stat_t st;
+    vfs_file_t *cache;
+    bool ok = false;
+
+    *native = NULL;
+
+    if(strlen(fname) > sizeof(path) - 5 || vfs_stat(fname, &st) != 0)
+        return false;
+
+    strcat(strcpy(path, fname), ".emc");
+
+    if((cache = vfs_open(path, "r"))) {
+
+        if(stitch_reader_open(&reader, cache) && native_open_file(&reader, &api) &&
+            native_is_cache_of(&st) && native_load_index(&reader, &design_index)) {
+            *native = cache;
+            design_native = true;
+            return true;
+        }
+
+        vfs_close(cache);
+        if(!open_file(fname, file)) // restore source decoder
+            return false;
+    }
+
+    if(embroidery_prescan(&reader, &api, &design_index)) {
+
+        if((cache = vfs_open(path, "w"))) {
+            ok = native_write(&reader, &api, &design_index, cache, &st);
+            vfs_close(cache);
+            if(!ok)
+                vfs_unlink(path);
+        }
+        ok = true;
+    }
+
+    return ok;
+}
+
+// Check design bounds from pre-scan against soft limits.
+// When transformed the bounding box of the transformed corners of the design bounds is checked.
+// In batch mode the bounds of the first and the last piece are checked.
+static bool design_within_limits (void)
+{
+    coord_data_t corner, min = api.min, max = api.max;
+
+#if EMBROIDERY_TRANSFORM
+    if(!transform.identity) {
+
+        uint_fast8_t idx;
+        stitch_position_t pos, bound;
+
+        for(idx = 0; idx < 4; idx++) {
+
+            bound.x = (int32_t)lroundf((idx & 1 ? api.max.x : api.min.x) * 10.0f);
+            bound.y = (int32_t)lroundf((idx & 2 ? api.max.y : api.min.y) * 10.0f);
+            transform_position(&pos, &bound);
+
+            if(idx == 0) {
+                min.x = max.x = (float)pos.x / 10.0f;
+                min.y = max.y = (float)pos.y / 10.0f;
+            } else {
+                min.x = min(min.x, (float)pos.x / 10.0f);
+                min.y = min(min.y, (float)pos.y / 10.0f);
+                max.x = max(max.x, (float)pos.x / 10.0f);
+                max.y = max(max.y, (float)pos.y / 10.0f);
+            }
+        }
+    }
+#endif
+
+    memcpy(&corner, &job.origin, sizeof(coord_data_t));
+
+    corner.x = job.origin.x + min.x;
+    corner.y = job.origin.y + min.y;
+
+    if(!system_check_travel_limits(corner.values))
+        return false;
+
+    corner.x = job.origin.x + max.x;
+    corner.y = job.origin.y + max.y;
+    if(embroidery.options.rotary_needle && !embroidery.sync_mode)
+        corner.z = job.origin.z + (float)EMBROIDERY_NEEDLE_WRAP * embroidery.z_travel; // Z travel before re-zeroing
+
+    if(!system_check_travel_limits(corner.values))
+        return false;
+
+    if(repeat.pieces > 1) {
+
+        float n = (float)(repeat.pieces - 1);
+
+        corner.x = job.origin.x + min.x + repeat.step.x * n;
+        corner.y = job.origin.y + min.y + repeat.step.y * n;
+
+        if(!system_check_travel_limits(corner.values))
+            return false;
+
+        corner.x = job.origin.x + max.x + repeat.step.x * n;
+        corner.y = job.origin.y + max.y + repeat.step.y * n;
+
+        return system_check_travel_limits(corner.values);
+    }
+
+    return true;
+}
+
 static status_code_t onFileOpen (const char *fname, vfs_file_t *file, bool stream)
 {
     bool ok = false;
 
-    if(brother_open_file(file, &api) || tajima_open_file(file, &api)) {
+    if(open_file(fname, file)) {
 
         if(stream) {
 
+            repeat.pieces = repeat.requested ? repeat.requested : 1;
+            repeat.requested = repeat.piece = 0;
+            memset(&repeat.executed, 0, sizeof(embroidery_job_details_t));
+
+            bool prescan = embroidery.options.prescan || embroidery.options.cache || design_native || resume.pending || repeat.pieces > 1;
+
+#if EMBROIDERY_TRANSFORM
+            prescan |= !transform.identity && settings.limits.flags.soft_enabled; // transformed bounds has to be checked
+#endif
+
+            bool indexed = false;
+            vfs_file_t *cache = NULL;
+
+            if(design_native)
+                indexed = native_load_index(&reader, &design_index);
+            else if(embroidery.options.cache || repeat.pieces > 1) // batch mode repeats from the native format cache
+                indexed = open_cache(fname, file, &cache);
+
+            if(prescan && !indexed && !embroidery_prescan(&reader, &api, &design_index)) {
+                if(cache)
+                    vfs_close(cache);
+                return Status_SDReadError;
+            }
+
+            repeat.offset = stitch_reader_tell(&reader);
+            repeat.state = api.get_state();
+
+            system_convert_array_steps_to_mpos(job.position.values, sys.position);
+            memcpy(&job.origin, &job.position, sizeof(coord_data_t));
+            job.stitch_pos.x = job.stitch_pos.y = 0;
+#if EMBROIDERY_TRANSFORM
+            job.transformed.x = job.transformed.y = 0;
+#endif
+            job.needle_turns = 0;
+
+            if(prescan && settings.limits.flags.soft_enabled && !design_within_limits()) {
+                if(cache)
+                    vfs_close(cache);
+                return Status_SoftLimitError;
+            }
+
             memcpy(&active_stream, &hal.stream, sizeof(io_stream_t));   // Save current stream pointers
             hal.stream.type = StreamType_File;                          // then redirect to read from SD card instead
             hal.stream.read = sdcard_read;                              // ...
@@ -459,69 +1701,67 @@ static status_code_t onFileOpen (const char *fname, vfs_file_t *file, bool strea
             plan_data_init(&job.plan_data);
 
             job.file = file;
+            job.cache = cache;
             job.completed = job.enqueued = job.await_trigger = job.paused = job.stitching = false;
             job.queue.head = job.queue.tail = job.stitch_interval = job.trigger_interval = 0;
+            batch.idx = batch.len = 0;
+            batch.eof = false;
+            memset(&merge, 0, sizeof(stitch_merge_t));
+            memset(&optimizer, 0, sizeof(stitch_optimizer_t));
+            resume.move.x = resume.move.y = 0;
+#if EMBROIDERY_TRANSFORM
+            if(!(transform.identity || resume.pending))
+                inject_origin_move();
+#endif
             job.plan_data.feed_rate = embroidery.feedrate;
             job.plan_data.condition.rapid_motion = On;
             if(embroidery.sync_mode)
                 job.plan_data.spindle.hal->get_data = spindleGetData;
-            job.plan_data.spindle.hal->cap.at_speed = On,
-            system_convert_array_steps_to_mpos(job.position.values, sys.position);
+            job.plan_data.spindle.hal->cap.at_speed = On;
 
             memset(&job.programmed, 0, sizeof(embroidery_job_details_t));
             memset(&job.executed, 0, sizeof(embroidery_job_details_t));
+            memset(&job.merged, 0, sizeof(embroidery_job_details_t));
 
             job.trigger_interval_min = 10000;
-            job.errs = job.exced = 0;
+            job.errs = job.exced = job.speed_errs = 0;
+            job.queue_empty = job.planner_starved = job.decode_us = job.decoded = 0;
+            reader.reads = reader.bytes = 0; // exclude pre-scan from decode statistics
+            job.starving = job.out_of_range = job.thread_break = false;
+            job.thread_breaks = job.backtracked = 0;
+            job.planner_blocks = 0;
+            job.history.count = job.replay.idx = job.replay.len = 0;
+            job.op = Stitch_Normal;
+            job.speed_scale = 1.0f;
+            job.needle_rpm = embroidery.needle_speed > 0.0f ? embroidery.needle_speed : 1.0f;
+
+#if EMBROIDERY_PROFILE
+            profile_reset();
+#endif
+            memset(&trigger_stats, 0, sizeof(trigger_stats_t));
+            triggers.tail = triggers.head;
+            triggers.overruns = 0;
 
-        } else {
+            if(resume.pending) {
+
+                status_code_t status;
 
-            bool no_move = false;
-            coord_data_t target = {0};
-            stich_type_t mode = Stitch_Stop;
-            stitch_t stitch;
-
-            stitch.target.x = stitch.target.y = 0.0f;
-
-            hal.stream.write("G17G21G91" ASCII_EOL);
-            hal.stream.write("F");
-            hal.stream.write(uitoa((uint32_t)embroidery.feedrate));
-            hal.stream.write(ASCII_EOL);
-
-            while(api.get_stitch(&stitch, file)) {
-
-                if(stitch.type == Stitch_Stop) {
-                    hal.stream.write("T");
-                    hal.stream.write(uitoa(stitch.color));
-                    hal.stream.write(" (MSG,");
-                    hal.stream.write(api.get_thread_color(stitch.color));
-                    hal.stream.write(")" ASCII_EOL);
-                } else if (stitch.type != Stitch_SequinEject) {
-
-                    no_move = target.x == 0.0f && target.y == 0.0f;
-
-                    if(no_move || mode != stitch.type) {
-                        hal.stream.write(stitch.type == Stitch_Jump ? "G0" : "G1");
-                        mode = stitch.type;
-                    }
-                    if(stitch.target.x != 0.0f) {
-                        hal.stream.write("X");
-                        hal.stream.write(trim(ftoa(stitch.target.x, N_DECIMAL_COORDVALUE_MM)));
-                        target.x = stitch.target.x;
-                    }
-                    if(stitch.target.y != 0.0f) {
-                        hal.stream.write("Y");
-                        hal.stream.write(trim(ftoa(stitch.target.y, N_DECIMAL_COORDVALUE_MM)));
-                        target.y = stitch.target.y;
-                    }
-                    hal.stream.write(ASCII_EOL);
-
-                    if(stitch.type == Stitch_Trim)
-                        hal.stream.write("M0 (MSG,Trim thread)" ASCII_EOL);
+                if((status = resume_job()) != Status_OK) {
+                    job.file = NULL; // left to the caller on error return
+                    end_job();
+                    return status;
                 }
             }
 
-            hal.stream.write("M30" ASCII_EOL);
+#if EMBROIDERY_DECODER_TASK
+            decoder.run = true;
+            xTaskNotifyGive(decoder.task);
+#endif
+
+        } else {
+
+            embroidery_export(&reader, &api, embroidery.feedrate, hal.stream.write);
+
             end_job();
         }
 
@@ -549,6 +1789,7 @@ static bool is_setting_available (const setting_detail_t *setting, uint_fast16_t
 
         case Setting_UserDefined_2:
         case Setting_UserDefined_5:
+        case Setting_UserDefined_7:
             ok = n_din > 0;
             break;
 
@@ -578,6 +1819,10 @@ static status_code_t set_port (setting_id_t setting, float value)
             embroidery.debug_port = value < 0.0f ? 0xFF : (uint8_t)value;
             break;
 
+        case Setting_UserDefined_5:
+            embroidery.break_port = value < 0.0f ? 0xFF : (uint8_t)value;
+            break;
+
         default: break;
     }
 
@@ -598,34 +1843,102 @@ static float get_port (setting_id_t setting)
             value = embroidery.debug_port >= n_dout ? -1.0f : (float)embroidery.debug_port;
             break;
 
+        case Setting_UserDefined_5:
+            value = embroidery.break_port >= n_din ? -1.0f : (float)embroidery.break_port;
+            break;
+
         default: break;
     }
 
     return value;
 }
 
+// Sync mode and trigger edge/input share a setting, 0 is off and 1 - 3 the trigger edge/input + 1.
+static status_code_t set_sync_mode (setting_id_t setting, uint_fast16_t value)
+{
+    if((embroidery.sync_mode = value != 0))
+        embroidery.edge = (embroidery_trig_t)(value - 1);
+
+    return Status_OK;
+}
+
+static uint32_t get_sync_mode (setting_id_t setting)
+{
+    return embroidery.sync_mode ? (uint32_t)embroidery.edge + 1 : 0;
+}
+
+// Jump mode is in the upper bits of the options setting, as cumulative bits: continue after jumps, merge jumps and merge trims.
+static status_code_t set_options (setting_id_t setting, uint_fast16_t value)
+{
+    embroidery.options.value = (uint8_t)(value & OPTIONS_MASK);
+    embroidery.jump_mode = value & bit(7) ? EmbroideryJump_MergeTrims
+                                          : (value & bit(6) ? EmbroideryJump_Merge
+                                                            : (value & bit(5) ? EmbroideryJump_StopNeedle : EmbroideryJump_Hold));
+
+    return Status_OK;
+}
+
+static uint32_t get_options (setting_id_t setting)
+{
+    uint32_t value = embroidery.options.value & OPTIONS_MASK, mode;
+
+    for(mode = EmbroideryJump_StopNeedle; mode <= embroidery.jump_mode; mode++)
+        value |= bit(4 + mode);
+
+    return value;
+}
+
 static const setting_detail_t embroidery_settings[] = {
     { Setting_UserDefined_0, Group_Embroidery, "Embroidery feedrate", "mm/min", Format_Decimal, "####0.0", NULL, NULL, Setting_NonCore, &embroidery.feedrate, NULL, NULL },
     { Setting_UserDefined_1, Group_Embroidery, "Embroidery Z travel", "mm", Format_Decimal, "##0.0", NULL, NULL, Setting_NonCore, &embroidery.z_travel, NULL, NULL },
     { Setting_UserDefined_2, Group_AuxPorts, "Embroidery trigger port", NULL, Format_Decimal, "-#0", "-1", max_port, Setting_NonCoreFn, set_port, get_port, is_setting_available, { .reboot_required = On } },
-    { Setting_UserDefined_3, Group_Embroidery, "Embroidery sync mode", NULL, Format_Bool, NULL, NULL, NULL, Setting_NonCore, &embroidery.sync_mode, NULL, NULL },
+    { Setting_UserDefined_3, Group_Embroidery, "Embroidery sync mode", NULL, Format_RadioButtons, "Off,Falling edge trigger,Rising edge trigger,Z limit trigger", NULL, NULL, Setting_NonCoreFn, set_sync_mode, get_sync_mode, NULL, { .reboot_required = On } },
     { Setting_UserDefined_4, Group_Embroidery, "Embroidery stop delay", "milliseconds", Format_Int16, "##0", NULL, NULL, Setting_NonCore, &embroidery.stop_delay, NULL, NULL },
-    { Setting_UserDefined_5, Group_Embroidery, "Trigger edge/input", NULL, Format_RadioButtons, "Falling,Rising,Z limit", NULL, NULL, Setting_NonCore, &embroidery.edge, NULL, NULL, { .reboot_required = On } },
+    { Setting_UserDefined_5, Group_AuxPorts, "Embroidery thread break port", NULL, Format_Decimal, "-#0", "-1", max_port, Setting_NonCoreFn, set_port, get_port, is_setting_available, { .reboot_required = On } },
     { Setting_UserDefined_6, Group_AuxPorts, "Embroidery debug port", NULL, Format_Decimal, "-#0", "-1", max_out_port, Setting_NonCoreFn, set_port, get_port, is_setting_available, { .reboot_required = On } },
+    { Setting_UserDefined_7, Group_Embroidery, "Embroidery thread break back-track", "stitches", Format_Int8, "#0", "1", max_backtrack, Setting_NonCore, &embroidery.backtrack, NULL, is_setting_available },
+    { Setting_UserDefined_8, Group_Embroidery, "Embroidery options", NULL, Format_Bitfield, "Pre-scan file,Rotary needle axis,Adaptive feedrate,Cache decoded design,Optimize stitches,Continue after jumps,Merge jumps,Merge trims with jumps", NULL, NULL, Setting_NonCoreFn, set_options, get_options, NULL },
+    { Setting_UserDefined_9, Group_Embroidery, "Embroidery max needle speed", "RPM", Format_Decimal, "###0", NULL, NULL, Setting_NonCore, &embroidery.needle_speed, NULL, NULL }
 };
 
 #ifndef NO_SETTINGS_DESCRIPTIONS
 
 static const setting_descr_t embroidery_settings_descr[] = {
     { Setting_UserDefined_0, "Feedrate to be used when embroidering." },
-    { Setting_UserDefined_1, "Z travel per stitch when needle is controlled by a stepper (sync mode = 0)." },
-    { Setting_UserDefined_2, "Aux input port to use for needle trigger (sync mode = 1, trigger edge <> Z limit input). Set to -1 to disable." },
-    { Setting_UserDefined_3, "When sync mode is enabled XY motion is controlled by needle trigger, else the Z axis stepper runs the needle motor." },
-    { Setting_UserDefined_4, "Delay after last needle trigger before stopping needle motor (sync mode = 1)." },
-    { Setting_UserDefined_5, "Trigger edge for needle trigger, from aux input or Z limit input (sync mode = 1).\\n\\n"
+    { Setting_UserDefined_1, "Z travel per stitch when needle is controlled by a stepper (sync mode off)." },
+    { Setting_UserDefined_2, "Aux input port to use for needle trigger (sync mode on, edge trigger). Set to -1 to disable." },
+    { Setting_UserDefined_3, "When sync mode is enabled XY motion is controlled by the needle trigger, else the Z axis stepper runs the needle motor.\n"
+                             "The trigger is the falling or rising edge of the aux input or the Z limit input.\n\n"
                              "NOTE: When Z limit input is used hard limits has to be enabled!"
     },
-    { Setting_UserDefined_6, "Debug port, outputs high on aux port when XY motion is ongoing. Set to -1 to disable." }
+    { Setting_UserDefined_4, "Delay after last needle trigger before stopping needle motor (sync mode on)." },
+    { Setting_UserDefined_5, "Aux input port to use for the thread break sensor, falling edge on break. Set to -1 to disable the thread break monitor.\n"
+                             "On a break while stitching the needle is stopped and backed up by up to the thread break back-track number of stitches, "
+                             "cycle start resumes sewing from there."
+    },
+    { Setting_UserDefined_6, "Debug port, outputs high on aux port when XY motion is ongoing. Set to -1 to disable." },
+    { Setting_UserDefined_7, "Max number of stitches backed up over and sewn again on a thread break.\n"
+                             "While the thread break monitor is enabled no more stitches than this are planned ahead so that all stitches "
+                             "moved after the needle is stopped are sewn again."
+    },
+    { Setting_UserDefined_8, "Pre-scan file: decode file on open for stitch counts, bounds and color block index.\n"
+                             "Bounds are checked against soft limits before motion starts when enabled.\n"
+                             "Rotary needle axis: Z stepper runs the needle continuously, Z travel is per needle revolution (sync mode off).\n"
+                             "XY motion is combined with the first half turn and two planner blocks are used per stitch instead of three.\n"
+                             "Adaptive feedrate: stitch feedrate is set from stitch length and measured needle period so that XY motion completes "
+                             "while the needle is up (sync mode on). Embroidery feedrate is used as the minimum.\n"
+                             "Cache decoded design: on first run the design is converted to a native stitch file with the .emc extension appended, "
+                             "later runs use it while the source file is unchanged. Implies pre-scan.\n"
+                             "Optimize stitches: merge stitches shorter than 0.3 mm into the next and combine collinear stitches up to 3 mm (compile time defaults).\n\n"
+                             "Handling of jumps following stitches, without continue the needle is stopped and feed hold entered, cycle start is required to continue.\n"
+                             "Continue after jumps: stop needle and continue with rapid motion.\n"
+                             "Merge jumps: as continue, consecutive jumps are merged to a single rapid move.\n"
+                             "Merge trims with jumps: as merge, trims are executed in place and their move merged with following jumps."
+    },
+    { Setting_UserDefined_9, "Max needle speed for closed loop needle speed control, requires a variable speed needle motor (sync mode on).\n"
+                             "Speed is reduced ahead of long stitches and when XY motion does not complete before the needle trigger.\n"
+                             "Set to 0 to disable, the needle motor is then switched on and off only."
+    }
 };
 
 #endif
@@ -642,6 +1955,11 @@ static void embroidery_settings_restore (void)
     embroidery.stop_delay = 0;
     embroidery.sync_mode = On;
     embroidery.debug_port = 0xFF;
+    embroidery.jump_mode = EmbroideryJump_Hold;
+    embroidery.options.value = 0;
+    embroidery.needle_speed = 0.0f;
+    embroidery.break_port = 0xFF;
+    embroidery.backtrack = 5;
     embroidery.port = ioport_find_free(Port_Digital, Port_Input, (pin_cap_t){ .irq_mode = (embroidery.edge ? IRQ_Mode_Rising : IRQ_Mode_Falling), .claimable = On }, "Embroidery needle trigger");
     embroidery.edge = embroidery.port != 0xFF ? EmbroideryTrig_Falling : EmbroideryTrig_ZLimit;
 
@@ -657,6 +1975,9 @@ static void embroidery_settings_load (void)
         embroidery.port = 0xFF;
     if(embroidery.debug_port >= n_dout)
         embroidery.debug_port = 0xFF;
+    if(embroidery.break_port >= n_din)
+        embroidery.break_port = 0xFF;
+    embroidery.backtrack = max(1, min(embroidery.backtrack, EMBROIDERY_BACKTRACK));
 
     if(embroidery.edge == EmbroideryTrig_ZLimit) {
 
@@ -676,18 +1997,486 @@ static void embroidery_settings_load (void)
             protocol_enqueue_foreground_task(report_warning, "Embroidery plugin failed to initialize, no pin for needle trigger signal!");
     }
 
+    if((break_port = embroidery.break_port) != 0xFF) {
+
+        xbar_t *portinfo = ioport_get_info(Port_Digital, Port_Input, break_port);
+
+        if(!(portinfo && !portinfo->mode.claimed && (portinfo->cap.irq_mode & IRQ_Mode_Falling) &&
+              ioport_claim(Port_Digital, Port_Input, &break_port, "Embroidery thread break") &&
+               hal.port.register_interrupt_handler(break_port, IRQ_Mode_Falling, thread_break))) {
+            break_port = 0xFF;
+            protocol_enqueue_foreground_task(report_warning, "Embroidery plugin failed to claim port for thread break sensor!");
+        }
+    }
+
     if((debug_port = embroidery.debug_port) != 0xFF) {
         if(!ioport_claim(Port_Digital, Port_Output, &debug_port, "Embroidery debug output"))
             debug_port = 0xFF;
     }
 }
 
+// Adds |EMB:<executed>/<programmed stitches>,<queue fill>,<sync errors>,<queue empty>,<planner starved> to the real time report while a job is running.
+static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    if(!job.completed) {
+        stream_write("|EMB:");
+        stream_write(uitoa(job.exced));
+        stream_write("/");
+        stream_write(uitoa(job.programmed.stitches));
+        stream_write(",");
+        stream_write(uitoa(queue_fill()));
+        stream_write(",");
+        stream_write(uitoa(job.errs));
+        stream_write(",");
+        stream_write(uitoa(job.queue_empty));
+        stream_write(",");
+        stream_write(uitoa(job.planner_starved));
+    }
+
+    if(on_realtime_report)
+        on_realtime_report(stream_write, report);
+}
+
+static void report_details (const char *name, embroidery_job_details_t *details)
+{
+    hal.stream.write("[EMB ");
+    hal.stream.write(name);
+    hal.stream.write(":");
+    hal.stream.write(uitoa(details->stitches));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(details->jumps));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(details->trims));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(details->thread_changes));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(details->sequin_ejects));
+    hal.stream.write("]" ASCII_EOL);
+}
+
+// $EMBS - report statistics for the current or last job.
+static status_code_t report_stats (sys_state_t state, char *args)
+{
+    uint_fast8_t bin;
+
+    report_details("PROGRAMMED", &job.programmed);
+    report_details("EXECUTED", &job.executed);
+    report_details("MERGED", &job.merged);
+
+    if(repeat.pieces > 1) {
+
+        embroidery_job_details_t total = repeat.executed;
+
+        add_details(&total, &job.executed);
+
+        hal.stream.write("[EMB BATCH:");
+        hal.stream.write(uitoa(repeat.piece + 1));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(repeat.pieces));
+        hal.stream.write("]" ASCII_EOL);
+
+        report_details("TOTAL", &total);
+    }
+
+    hal.stream.write("[EMB OPTIMIZED:");
+    hal.stream.write(uitoa(optimizer.micro));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(optimizer.collinear));
+    hal.stream.write("]" ASCII_EOL);
+
+#if EMBROIDERY_TRANSFORM
+    hal.stream.write("[EMB TRANSFORM:");
+    hal.stream.write(ftoa((float)transform.offset.x / 10.0f, 1));
+    hal.stream.write(",");
+    hal.stream.write(ftoa((float)transform.offset.y / 10.0f, 1));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(transform.rotation, 2));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(transform.scale, 3));
+    hal.stream.write(",");
+    hal.stream.write(transform.mirror_x ? (transform.mirror_y ? "HV" : "H") : (transform.mirror_y ? "V" : "-"));
+    hal.stream.write("]" ASCII_EOL);
+#endif
+
+    hal.stream.write("[EMB BREAK:");
+    hal.stream.write(uitoa(job.thread_breaks));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job.backtracked));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[EMB QUEUE:");
+    hal.stream.write(uitoa(queue_fill()));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(STITCH_QUEUE_SIZE - 1));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job.queue_empty));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job.planner_starved));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[EMB DECODE:");
+    hal.stream.write(ftoa(job.decoded ? (float)job.decode_us / (float)job.decoded : 0.0f, 1));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job.decode_us ? (uint32_t)((uint64_t)job.decoded * 1000000UL / job.decode_us) : 0));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(job.decoded ? (float)reader.bytes / (float)job.decoded : 0.0f, 2));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(job.decoded ? (float)reader.reads / (float)job.decoded : 0.0f, 3));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[EMB SYNC:");
+    hal.stream.write(uitoa(job.exced));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job.errs));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job.stitch_interval));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job.trigger_interval_min));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[EMB NEEDLE:");
+    hal.stream.write(ftoa(trigger_stats.count ? 60000000.0f / trigger_stats.period : 0.0f, 0));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(trigger_stats.period, 0));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(trigger_stats.jitter, 0));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(trigger_stats.period_min));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(trigger_stats.period_max));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(triggers.overruns));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[EMB HISTOGRAM:");
+    for(bin = 0; bin < TRIGGER_HISTOGRAM_BINS; bin++) {
+        if(bin)
+            hal.stream.write(",");
+        hal.stream.write(uitoa(trigger_stats.histogram[bin]));
+    }
+    hal.stream.write("]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+#if EMBROIDERY_PROFILE
+
+// $EMBP - report hot path profile for the current or last job.
+static status_code_t report_profile (sys_state_t state, char *args)
+{
+    profile_report();
+
+    return Status_OK;
+}
+
+#endif
+
+// $EMBR=<n> - resume next job at stitch record <n>, $EMBR=C<n> - resume next job at color block <n>, $EMBR - cancel.
+static status_code_t set_resume (sys_state_t state, char *args)
+{
+    float value;
+    uint_fast8_t idx = 0;
+    bool block = false;
+
+    if(args == NULL) {
+        resume.pending = false;
+        return Status_OK;
+    }
+
+    strcaps(args);
+
+    if((block = *args == 'C'))
+        idx++;
+
+    if(!read_float(args, &idx, &value) || !isintf(value) || value < 0.0f)
+        return Status_BadNumberFormat;
+
+    resume.block = block;
+    resume.value = (uint32_t)value;
+    resume.pending = true;
+
+    return Status_OK;
+}
+
+#if EMBROIDERY_TRANSFORM
+
+// $EMBT=X<offset>Y<offset>R<degrees>S<scale>H|V - transform following jobs, $EMBT - cancel.
+// Words may be given in any order, H mirrors X and V mirrors Y. Mirror and scale is applied first, then rotation and offset.
+static status_code_t set_transform (sys_state_t state, char *args)
+{
+    float value, rad;
+    uint_fast8_t idx = 0;
+    embroidery_transform_t t = { .scale = 1.0f };
+
+    if(!job.completed)
+        return Status_IdleError;
+
+    if(args) {
+
+        strcaps(args);
+
+        while(args[idx]) {
+
+            char letter = args[idx++];
+
+            if(letter == 'H')
+                t.mirror_x = true;
+            else if(letter == 'V')
+                t.mirror_y = true;
+            else if(!read_float(args, &idx, &value))
+                return Status_BadNumberFormat;
+            else switch(letter) {
+
+                case 'X':
+                    if(fabsf(value) > TRANSFORM_OFFSET_MAX)
+                        return Status_GcodeValueOutOfRange;
+                    t.offset.x = (int32_t)lroundf(value * 10.0f);
+                    break;
+
+                case 'Y':
+                    if(fabsf(value) > TRANSFORM_OFFSET_MAX)
+                        return Status_GcodeValueOutOfRange;
+                    t.offset.y = (int32_t)lroundf(value * 10.0f);
+                    break;
+
+                case 'R':
+                    t.rotation = fmodf(value, 360.0f);
+                    break;
+
+                case 'S':
+                    if(value < TRANSFORM_SCALE_MIN || value > TRANSFORM_SCALE_MAX)
+                        return Status_GcodeValueOutOfRange;
+                    t.scale = value;
+                    break;
+
+                default:
+                    return Status_GcodeUnsupportedCommand;
+            }
+        }
+    }
+
+    rad = t.rotation * (float)M_PI / 180.0f;
+    t.a = (int32_t)lroundf(cosf(rad) * t.scale * (t.mirror_x ? -65536.0f : 65536.0f));
+    t.b = (int32_t)lroundf(-sinf(rad) * t.scale * (t.mirror_y ? -65536.0f : 65536.0f));
+    t.c = (int32_t)lroundf(sinf(rad) * t.scale * (t.mirror_x ? -65536.0f : 65536.0f));
+    t.d = (int32_t)lroundf(cosf(rad) * t.scale * (t.mirror_y ? -65536.0f : 65536.0f));
+    t.identity = t.a == 65536 && t.b == 0 && t.c == 0 && t.d == 65536 && t.offset.x == 0 && t.offset.y == 0;
+
+    memcpy(&transform, &t, sizeof(embroidery_transform_t));
+
+    return Status_OK;
+}
+
+#endif
+
+// $EMBB=<n>X<step>Y<step>P<seconds> - sew the next job <n> times, $EMBB - cancel.
+// The origin is offset by the optional X and Y step between pieces, P is the hoop change pause, 0 or none waits for cycle start.
+static status_code_t set_repeat (sys_state_t state, char *args)
+{
+    float value;
+    uint_fast8_t idx = 0;
+    embroidery_repeat_t r = {0};
+
+    if(args == NULL) {
+        repeat.requested = 0;
+        return Status_OK;
+    }
+
+    strcaps(args);
+
+    if(!read_float(args, &idx, &value) || !isintf(value) || value < 1.0f)
+        return Status_BadNumberFormat;
+
+    r.requested = (uint32_t)value;
+
+    while(args[idx]) {
+
+        char letter = args[idx++];
+
+        if(!read_float(args, &idx, &value))
+            return Status_BadNumberFormat;
+
+        switch(letter) {
+
+            case 'X':
+                r.step.x = value;
+                break;
+
+            case 'Y':
+                r.step.y = value;
+                break;
+
+            case 'P':
+                if(value < 0.0f)
+                    return Status_GcodeValueOutOfRange;
+                r.pause = value;
+                break;
+
+            default:
+                return Status_GcodeUnsupportedCommand;
+        }
+    }
+
+    repeat.requested = r.requested;
+    repeat.step = r.step;
+    repeat.pause = r.pause;
+
+    return Status_OK;
+}
+
+static struct {
+    vfs_file_t *file;
+    bool error;
+} export;
+
+static void export_write (const char *s)
+{
+    size_t len = strlen(s);
+
+    if(!export.error && vfs_write(s, 1, len, export.file) != len)
+        export.error = true;
+}
+
+// $EMBX=<filename> - convert design to G-code, output to a file with the same name and .nc extension.
+static status_code_t export_design (sys_state_t state, char *args)
+{
+    char path[128], *ext;
+    vfs_file_t *file;
+    bool ok;
+
+    if(args == NULL)
+        return Status_InvalidStatement;
+
+    if(state != STATE_IDLE || !job.completed)
+        return Status_IdleError;
+
+    if(strlen(args) > sizeof(path) - 4)
+        return Status_GcodeValueOutOfRange;
+
+    if((file = vfs_open(args, "r")) == NULL)
+        return Status_SDFailedOpenFile;
+
+    if(!open_file(args, file)) {
+        vfs_close(file);
+        return Status_InvalidStatement;
+    }
+
+    strcpy(path, args);
+    if((ext = strrchr(path, '.')) == NULL || strchr(ext, '/'))
+        ext = strchr(path, '\0');
+    strcpy(ext, ".nc");
+
+    if((export.file = vfs_open(path, "w")) == NULL) {
+        vfs_close(file);
+        return Status_SDFailedOpenFile;
+    }
+
+    export.error = false;
+    embroidery_export(&reader, &api, embroidery.feedrate, export_write);
+
+    ok = !export.error;
+
+    vfs_close(export.file);
+    vfs_close(file);
+
+    if(ok)
+        report_message(path, Message_Plain);
+
+    return ok ? Status_OK : Status_SDReadError;
+}
+
+// $EMBE=<filename> - dry run design and output cycle time estimate, total and per color block.
+static status_code_t estimate_design (sys_state_t state, char *args)
+{
+    uint_fast16_t idx;
+    vfs_file_t *file, *cache = NULL;
+    embroidery_estimate_params_t params = {0};
+    static embroidery_estimate_t estimate; // too large for the stack on some targets
+    bool ok;
+
+    if(args == NULL)
+        return Status_InvalidStatement;
+
+    if(state != STATE_IDLE || !job.completed)
+        return Status_IdleError;
+
+    if((file = vfs_open(args, "r")) == NULL)
+        return Status_SDFailedOpenFile;
+
+    if(!open_file(args, file)) {
+        vfs_close(file);
+        return Status_InvalidStatement;
+    }
+
+    if(embroidery.options.cache && !design_native)
+        open_cache(args, file, &cache); // native format decodes faster, creates the cache if not current
+
+    params.feedrate = embroidery.feedrate / 60.0f;
+    params.max_rate = min(settings.axis[X_AXIS].max_rate, settings.axis[Y_AXIS].max_rate) / 60.0f;
+    params.acceleration = min(settings.axis[X_AXIS].acceleration, settings.axis[Y_AXIS].acceleration) / 3600.0f;
+    params.z_max_rate = settings.axis[Z_AXIS].max_rate / 60.0f;
+    params.z_acceleration = settings.axis[Z_AXIS].acceleration / 3600.0f;
+    params.z_travel = embroidery.z_travel;
+    params.move_window = (float)EMBROIDERY_MOVE_WINDOW / 100.0f;
+    params.stop_delay = embroidery.sync_mode ? (float)embroidery.stop_delay / 1000.0f : 0.0f;
+    params.trim_time = (float)EMBROIDERY_TRIM_TIME / 1000.0f;
+    params.color_change_time = (float)EMBROIDERY_COLOR_CHANGE_TIME / 1000.0f;
+    params.sync_mode = embroidery.sync_mode;
+    params.rotary_needle = embroidery.options.rotary_needle;
+    params.adaptive_feed = embroidery.options.adaptive_feed;
+    params.merge_jumps = embroidery.jump_mode >= EmbroideryJump_Merge;
+    params.hold_jumps = embroidery.jump_mode == EmbroideryJump_Hold;
+    // Needle period from max needle speed if set, else as measured by the last job.
+    if(embroidery.sync_mode) {
+        params.needle_period = embroidery.needle_speed > 0.0f ? 60.0f / embroidery.needle_speed : trigger_stats.period / 1000000.0f;
+        if(params.needle_period == 0.0f)
+            report_message("Needle period not known, set max needle speed or run a job. Estimate is for motion only", Message_Warning);
+    }
+
+    ok = embroidery_estimate(&reader, &api, &params, &estimate);
+
+    if(cache)
+        vfs_close(cache);
+    vfs_close(file);
+
+    if(ok) {
+
+        hal.stream.write("[EMB ESTIMATE:");
+        hal.stream.write(ftoa(estimate.time, 1));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(estimate.stitches));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(estimate.jumps));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(estimate.trims));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(estimate.color_changes));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(estimate.holds));
+        hal.stream.write("]" ASCII_EOL);
+
+        for(idx = 0; idx < estimate.n_blocks; idx++) {
+            hal.stream.write("[EMB BLOCK:");
+            hal.stream.write(uitoa(idx));
+            hal.stream.write(",");
+            hal.stream.write(uitoa(estimate.block[idx].color));
+            hal.stream.write(",");
+            hal.stream.write(uitoa(estimate.block[idx].stitches));
+            hal.stream.write(",");
+            hal.stream.write(ftoa(estimate.block[idx].time, 1));
+            hal.stream.write("]" ASCII_EOL);
+        }
+    }
+
+    return ok ? Status_OK : Status_SDReadError;
+}
+
 static void onReportOptions (bool newopt)
 {
     on_report_options(newopt);
 
     if(!newopt)
-        report_plugin("EMBROIDERY", "0.09");
+        report_plugin("EMBROIDERY", "0.10");
 }
 
 const char *embroidery_get_thread_color (embroidery_thread_color_t color)
@@ -705,6 +2494,41 @@ void embroidery_set_thread_change_handler (thread_change_ptr handler)
     api.thread_change = handler;
 }
 
+void embroidery_set_thread_trim_async_handler (thread_trim_async_ptr handler)
+{
+    api.thread_trim_async = handler;
+}
+
+void embroidery_set_thread_change_async_handler (thread_change_async_ptr handler)
+{
+    api.thread_change_async = handler;
+}
+
+// To be called by asynchronous handlers on completion, may be called from interrupt context.
+void embroidery_op_completed (bool ok)
+{
+    job.op_status = ok ? EmbroideryOp_Done : EmbroideryOp_Failed;
+}
+
+static const sys_command_t embroidery_command_list[] = {
+    { "EMBR", set_resume, {0}, { .str = "resume next embroidery job from stitch $EMBR=<n> or color block $EMBR=C<n>" } },
+#if EMBROIDERY_TRANSFORM
+    { "EMBT", set_transform, {0}, { .str = "transform embroidery jobs $EMBT=X<offset>Y<offset>R<degrees>S<scale>H|V" } },
+#endif
+    { "EMBB", set_repeat, {0}, { .str = "sew next embroidery job repeatedly $EMBB=<n>X<step>Y<step>P<seconds>" } },
+    { "EMBX", export_design, {0}, { .str = "convert embroidery file to G-code file $EMBX=<filename>" } },
+    { "EMBE", estimate_design, {0}, { .str = "estimate embroidery cycle time $EMBE=<filename>" } },
+    { "EMBS", report_stats, { .noargs = On }, { .str = "output embroidery job statistics" } },
+#if EMBROIDERY_PROFILE
+    { "EMBP", report_profile, { .noargs = On }, { .str = "output embroidery hot path profile" } },
+#endif
+};
+
+static sys_commands_t embroidery_commands = {
+    .n_commands = sizeof(embroidery_command_list) / sizeof(sys_command_t),
+    .commands = embroidery_command_list
+};
+
 void embroidery_init (void)
 {
     static setting_details_t setting_details = {
@@ -725,6 +2549,13 @@ void embroidery_init (void)
 
         job.completed = true;
         active_stream.type = StreamType_Null;
+        get_micros = hal.get_micros ? hal.get_micros : get_micros_ms;
+#if EMBROIDERY_PROFILE
+        profile_init();
+#endif
+#if EMBROIDERY_DECODER_TASK
+        xTaskCreatePinnedToCore(decoder_task, "embroidery", 4096, NULL, uxTaskPriorityGet(NULL), &decoder.task, xPortGetCoreID() ? 0 : 1);
+#endif
 
         n_din = ioports_available(Port_Digital, Port_Input);
         strcpy(max_port, uitoa(n_din - 1));
@@ -732,8 +2563,12 @@ void embroidery_init (void)
         n_dout = ioports_available(Port_Digital, Port_Output);
         strcpy(max_out_port, uitoa(n_dout - 1));
 
+        strcpy(max_backtrack, uitoa(EMBROIDERY_BACKTRACK));
+
         settings_register(&setting_details);
 
+        system_register_commands(&embroidery_commands);
+
         on_report_options = grbl.on_report_options;
         grbl.on_report_options = onReportOptions;
 
@@ -749,6 +2584,9 @@ void embroidery_init (void)
         on_execute_realtime = grbl.on_execute_realtime;
         grbl.on_execute_realtime = onExecuteRealtime;
 
+        on_realtime_report = grbl.on_realtime_report;
+        grbl.on_realtime_report = onRealtimeReport;
+
         api.thread_trim = thread_trim;
         api.thread_change = thread_change;
     } else
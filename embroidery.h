@@ -36,24 +36,158 @@ typedef enum {
 
 typedef uint8_t embroidery_thread_color_t;
 
+#ifndef STITCH_READER_BUFFER_SIZE
+#define STITCH_READER_BUFFER_SIZE 512 // must be a power of 2, preferably the SD card sector size
+#endif
+
+#ifndef EMBROIDERY_EXPORT_BUFFER
+#define EMBROIDERY_EXPORT_BUFFER 512 // G-code conversion output is written in blocks of up to this size
+#endif
+
+#ifndef EMBROIDERY_PREFETCH
+#define EMBROIDERY_PREFETCH 1 // set to 0 to disable read-ahead of the next block, saves STITCH_READER_BUFFER_SIZE bytes of RAM
+#endif
+
+typedef struct {
+    vfs_file_t *file;
+    size_t offset;  // file offset of data[0]
+    uint16_t pos;
+    uint16_t len;
+    uint32_t reads; // number of vfs_read() calls, for throughput statistics
+    uint32_t bytes; // number of bytes read from the file
+#if EMBROIDERY_PREFETCH
+    uint8_t *data;  // current block, points to one of buf
+    uint8_t *next;  // prefetched block, points to the other
+    uint16_t next_len;
+    bool prefetched;
+    uint8_t buf[2][STITCH_READER_BUFFER_SIZE];
+#else
+    uint8_t data[STITCH_READER_BUFFER_SIZE];
+#endif
+} stitch_reader_t;
+
+typedef struct {
+    int16_t x; // mm / 10
+    int16_t y; // mm / 10
+} stitch_delta_t;
+
 typedef struct {
     stich_type_t type;
     embroidery_thread_color_t color;
-    coord_data_t target;
+    stitch_delta_t delta;
 } stitch_t;
 
-typedef bool (*get_stitch_ptr)(stitch_t *stitch, vfs_file_t *file);
+#define STITCH_PACKED_MAX 8191 // max absolute delta of a packed stitch, mm / 10
+
+// Packed stitch, used for the stitch queue and the native format.
+// The thread color of Stop records is carried in y, Stop records with motion has color 0.
+typedef union {
+    uint32_t value;
+    struct {
+        int32_t x      :14; // mm / 10
+        int32_t y      :14; // mm / 10
+        uint32_t type  :3;
+        uint32_t color :1;  // y is the thread color
+    };
+} stitch_packed_t;
+
+// Returns false if the stitch cannot be represented, out of range or a Stop record with both motion and a color.
+static inline bool stitch_pack (stitch_packed_t *packed, const stitch_t *stitch)
+{
+    if(stitch->delta.x > STITCH_PACKED_MAX || stitch->delta.x < -STITCH_PACKED_MAX ||
+        stitch->delta.y > STITCH_PACKED_MAX || stitch->delta.y < -STITCH_PACKED_MAX)
+        return false;
+
+    packed->type = stitch->type;
+    packed->x = stitch->delta.x;
+
+    if((packed->color = stitch->type == Stitch_Stop && stitch->delta.x == 0 && stitch->delta.y == 0))
+        packed->y = stitch->color;
+    else {
+        packed->y = stitch->delta.y;
+        if(stitch->type == Stitch_Stop && stitch->color)
+            return false;
+    }
+
+    return true;
+}
+
+static inline void stitch_unpack (stitch_t *stitch, stitch_packed_t packed)
+{
+    stitch->type = (stich_type_t)packed.type;
+    stitch->delta.x = packed.x;
+    if(packed.color) {
+        stitch->color = (embroidery_thread_color_t)packed.y;
+        stitch->delta.y = 0;
+    } else {
+        stitch->color = 0;
+        stitch->delta.y = packed.y;
+    }
+}
+
+typedef struct {
+    int32_t x; // mm / 10
+    int32_t y; // mm / 10
+} stitch_position_t;
+
+#ifndef EMBROIDERY_MAX_BLOCKS
+#define EMBROIDERY_MAX_BLOCKS 32 // max number of color blocks indexed by pre-scan
+#endif
+#ifndef EMBROIDERY_MAX_CHECKPOINTS
+#define EMBROIDERY_MAX_CHECKPOINTS 64 // max number of periodic checkpoints recorded by pre-scan, must be even
+#endif
+
+// Decoder restart point, offset and state are taken before the record at index stitch is read.
+typedef struct {
+    uint32_t offset;
+    uint32_t stitch;
+    uint32_t state;
+    stitch_position_t position;
+    embroidery_thread_color_t color;
+} embroidery_checkpoint_t;
+
+typedef struct {
+    bool valid;
+    uint32_t records;
+    uint32_t interval; // stitch records between periodic checkpoints
+    uint_fast16_t n_blocks;
+    uint_fast16_t n_checkpoints;
+    embroidery_checkpoint_t block[EMBROIDERY_MAX_BLOCKS];
+    embroidery_checkpoint_t checkpoint[EMBROIDERY_MAX_CHECKPOINTS];
+} embroidery_index_t;
+
+typedef bool (*get_stitch_ptr)(stitch_t *stitch, stitch_reader_t *reader);
+typedef uint_fast16_t (*get_stitches_ptr)(stitch_t *stitches, uint_fast16_t count, stitch_reader_t *reader);
+typedef uint32_t (*get_decoder_state_ptr)(void);
+typedef void (*set_decoder_state_ptr)(uint32_t state);
 typedef const char *(*get_thread_color_ptr)(uint8_t color);
 typedef void (*thread_trim_ptr)(void);
 typedef void (*thread_change_ptr)(embroidery_thread_color_t color);
 
+typedef enum {
+    EmbroideryOp_Done = 0,      // completed, job continues
+    EmbroideryOp_InProgress,    // started, embroidery_op_completed() has to be called on completion
+    EmbroideryOp_Failed         // failed, job is paused with a feed hold for operator intervention
+} embroidery_op_status_t;
+
+// Asynchronous handlers are called from the realtime loop when motion has completed and the needle is stopped.
+// They must not block, outputs are to be driven by the handler and embroidery_op_completed() called when done.
+typedef embroidery_op_status_t (*thread_trim_async_ptr)(void);
+typedef embroidery_op_status_t (*thread_change_async_ptr)(embroidery_thread_color_t color);
+
 typedef struct {
     get_stitch_ptr get_stitch;
+    get_stitches_ptr get_stitches; // optional
+    get_decoder_state_ptr get_state;
+    set_decoder_state_ptr set_state;
     get_thread_color_ptr get_thread_color;
     thread_trim_ptr thread_trim;
     thread_change_ptr thread_change;
+    thread_trim_async_ptr thread_trim_async;        // optional, used instead of thread_trim if set
+    thread_change_async_ptr thread_change_async;    // optional, used instead of thread_change if set
     const char *name;
     uint32_t stitches;
+    uint32_t jumps;
     uint32_t threads;
     uint32_t trims;
     uint32_t color_changes;
@@ -62,10 +196,79 @@ typedef struct {
     coord_data_t size;
 } embroidery_t;
 
-typedef bool (*open_file_ptr)(vfs_file_t *file, embroidery_t *api);
+typedef bool (*open_file_ptr)(stitch_reader_t *reader, embroidery_t *api);
+
+typedef struct {
+    const char *extension;  // uppercase, including the leading period
+    const char *magic;      // identifying bytes at start of file
+    uint8_t magic_len;
+    open_file_ptr open;
+} embroidery_format_t;
+
+typedef struct {
+    float feedrate;             // mm/s
+    float max_rate;             // XY, mm/s
+    float acceleration;         // XY, mm/s^2
+    float z_max_rate;           // mm/s
+    float z_acceleration;       // mm/s^2
+    float z_travel;             // mm
+    float needle_period;        // s, 0 if not known
+    float move_window;          // part of needle period available for XY motion with adaptive feedrate
+    float stop_delay;           // s
+    float trim_time;            // s
+    float color_change_time;    // s
+    bool sync_mode;
+    bool rotary_needle;
+    bool adaptive_feed;
+    bool merge_jumps;
+    bool hold_jumps;
+} embroidery_estimate_params_t;
+
+typedef struct {
+    embroidery_thread_color_t color;
+    uint32_t stitches;
+    float time; // s
+} embroidery_estimate_block_t;
+
+typedef struct {
+    float time; // s
+    uint32_t stitches;
+    uint32_t jumps;
+    uint32_t trims;
+    uint32_t color_changes;
+    uint32_t holds; // feed holds requiring cycle start, not included in time
+    uint_fast16_t n_blocks;
+    embroidery_estimate_block_t block[EMBROIDERY_MAX_BLOCKS];
+} embroidery_estimate_t;
+
+bool embroidery_prescan (stitch_reader_t *reader, embroidery_t *api, embroidery_index_t *index);
+bool embroidery_seek (stitch_reader_t *reader, embroidery_t *api, embroidery_index_t *index, uint32_t stitch, embroidery_checkpoint_t *position);
+
+bool native_is_cache_of (const vfs_stat_t *source);
+bool native_load_index (stitch_reader_t *reader, embroidery_index_t *index);
+bool native_write (stitch_reader_t *reader, embroidery_t *api, embroidery_index_t *index, vfs_file_t *file, const vfs_stat_t *source);
+
+bool stitch_reader_open (stitch_reader_t *reader, vfs_file_t *file);
+int16_t stitch_reader_fill (stitch_reader_t *reader);
+size_t stitch_reader_read (stitch_reader_t *reader, void *buf, size_t size);
+bool stitch_reader_seek (stitch_reader_t *reader, size_t offset);
+size_t stitch_reader_tell (stitch_reader_t *reader);
+bool stitch_reader_prefetch (stitch_reader_t *reader);
+
+bool embroidery_estimate (stitch_reader_t *reader, embroidery_t *api, const embroidery_estimate_params_t *params, embroidery_estimate_t *estimate);
+void embroidery_export (stitch_reader_t *reader, embroidery_t *api, float feedrate, stream_write_ptr write);
+
+// Returns next byte from the read-ahead buffer or -1 on end of file.
+static inline int16_t stitch_reader_getc (stitch_reader_t *reader)
+{
+    return reader->pos < reader->len ? reader->data[reader->pos++] : stitch_reader_fill(reader);
+}
 
 const char *embroidery_get_thread_color (embroidery_thread_color_t color);
 void embroidery_set_thread_trim_handler (thread_trim_ptr handler);
 void embroidery_set_thread_change_handler (thread_change_ptr handler);
+void embroidery_set_thread_trim_async_handler (thread_trim_async_ptr handler);
+void embroidery_set_thread_change_async_handler (thread_change_async_ptr handler);
+void embroidery_op_completed (bool ok);
 
 #endif // _EMBROIDERY_H_
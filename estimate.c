@@ -0,0 +1,160 @@
+/*
+
+  estimate.c - dry run of embroidery file stitch data for cycle time estimation.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "embroidery.h"
+
+#if EMBROIDERY_ENABLE
+
+#include <string.h>
+#include <math.h>
+
+static const embroidery_estimate_params_t *params;
+
+// Time in seconds for a move of length mm starting and ending at rest, trapezoidal or triangular velocity profile.
+static float move_time (float length, float rate, float acceleration)
+{
+    float accel_dist = rate * rate / acceleration;
+
+    if(length <= 0.0f)
+        return 0.0f;
+
+    return length < accel_dist ? 2.0f * sqrtf(length / acceleration) : length / rate + rate / acceleration;
+}
+
+static inline float delta_length (const stitch_delta_t *delta)
+{
+    return sqrtf((float)((int32_t)delta->x * delta->x + (int32_t)delta->y * delta->y)) / 10.0f;
+}
+
+static float stitch_time (const stitch_delta_t *delta)
+{
+    float t, rate = params->feedrate, length = delta_length(delta);
+
+    if(params->sync_mode) {
+        // XY motion is started by the needle trigger, with adaptive feedrate it is to complete within the move window.
+        if(params->adaptive_feed && params->needle_period > 0.0f)
+            rate = max(rate, length / (params->needle_period * params->move_window));
+        t = move_time(length, min(rate, params->max_rate), params->acceleration);
+        t = max(t, params->needle_period);
+    } else if(params->rotary_needle) {
+        float half = params->z_travel * 0.5f;
+        t = move_time(sqrtf(length * length + half * half), min(rate, params->max_rate), params->acceleration) +
+             move_time(half, min(rate, params->z_max_rate), params->z_acceleration);
+    } else
+        t = move_time(length, min(rate, params->max_rate), params->acceleration) +
+             2.0f * move_time(params->z_travel * 2.0f, min(rate, params->z_max_rate), params->z_acceleration);
+
+    return t;
+}
+
+static inline float jump_time (const stitch_delta_t *delta)
+{
+    return move_time(delta_length(delta), params->max_rate, params->acceleration);
+}
+
+// Decodes all stitch data and estimates the cycle time per color block, no motion is performed.
+// Color blocks are delimited as by embroidery_prescan(), blocks beyond EMBROIDERY_MAX_BLOCKS are added to the last.
+// The reader and decoder is restored to the start of the stitch data on return.
+bool embroidery_estimate (stitch_reader_t *reader, embroidery_t *api, const embroidery_estimate_params_t *estimate_params, embroidery_estimate_t *estimate)
+{
+    stitch_t stitch;
+    uint32_t n = 0, state = api->get_state();
+    size_t offset = stitch_reader_tell(reader);
+    bool stitching = false;
+    stitch_delta_t jump = {0};
+    embroidery_estimate_block_t *block = NULL;
+
+    params = estimate_params;
+
+    memset(estimate, 0, sizeof(embroidery_estimate_t));
+
+    while(api->get_stitch(&stitch, reader)) {
+
+        if(stitch.type == Stitch_Stop || n == 0) {
+            if(estimate->n_blocks < EMBROIDERY_MAX_BLOCKS)
+                block = &estimate->block[estimate->n_blocks++];
+            block->color = stitch.type == Stitch_Stop ? stitch.color : 0;
+        }
+
+        // Pending merged jump is executed when followed by anything but another jump.
+        if((jump.x || jump.y) && stitch.type != Stitch_Jump) {
+            block->time += jump_time(&jump);
+            jump.x = jump.y = 0;
+        }
+
+        // Needle is stopped, stop delay is taken before non stitch motion starts.
+        if(stitching && stitch.type != Stitch_Normal) {
+            block->time += params->stop_delay;
+            if(stitch.type == Stitch_Jump && params->hold_jumps)
+                estimate->holds++;
+        }
+
+        switch(stitch.type) {
+
+            case Stitch_Normal:
+                block->stitches++;
+                estimate->stitches++;
+                block->time += stitch_time(&stitch.delta);
+                break;
+
+            case Stitch_Jump:
+                estimate->jumps++;
+                if(params->merge_jumps) {
+                    jump.x += stitch.delta.x;
+                    jump.y += stitch.delta.y;
+                } else
+                    block->time += jump_time(&stitch.delta);
+                break;
+
+            case Stitch_Trim:
+                estimate->trims++;
+                block->time += jump_time(&stitch.delta) + params->trim_time;
+                break;
+
+            case Stitch_Stop:
+                if(n) {
+                    estimate->color_changes++;
+                    block->time += params->color_change_time;
+                }
+                block->time += jump_time(&stitch.delta);
+                break;
+
+            default:
+                break;
+        }
+
+        stitching = stitch.type == Stitch_Normal;
+        n++;
+    }
+
+    if(block && (jump.x || jump.y))
+        block->time += jump_time(&jump);
+
+    for(n = 0; n < estimate->n_blocks; n++)
+        estimate->time += estimate->block[n].time;
+
+    api->set_state(state);
+
+    return stitch_reader_seek(reader, offset);
+}
+
+#endif // EMBROIDERY_ENABLE
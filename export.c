@@ -0,0 +1,145 @@
+/*
+
+  export.c - converts embroidery file stitch data to G-code.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "embroidery.h"
+
+#if EMBROIDERY_ENABLE
+
+#include <string.h>
+
+#define EXPORT_MAX_LINE 64 // longest line that can be appended before a flush is required
+
+static struct {
+    uint_fast16_t len;
+    stream_write_ptr write;
+    char data[EMBROIDERY_EXPORT_BUFFER + EXPORT_MAX_LINE + 1];
+} out;
+
+// Write buffer content in blocks of EMBROIDERY_EXPORT_BUFFER size, keep the remainder.
+// File output is thus written in sector sized chunks when the buffer size is a multiple of the sector size.
+static void export_flush (bool all)
+{
+    if(all || out.len >= EMBROIDERY_EXPORT_BUFFER) {
+
+        uint_fast16_t len = all ? out.len : EMBROIDERY_EXPORT_BUFFER;
+        char c = out.data[len];
+
+        out.data[len] = '\0';
+        out.write(out.data);
+        out.data[len] = c;
+
+        if((out.len -= len))
+            memmove(out.data, &out.data[len], out.len);
+    }
+}
+
+static void export_puts (const char *s)
+{
+    while(*s)
+        out.data[out.len++] = *s++;
+}
+
+static void export_uint (uint32_t value)
+{
+    char buf[10], *p = &buf[sizeof(buf)];
+
+    do {
+        *--p = '0' + value % 10;
+    } while(value /= 10);
+
+    while(p < &buf[sizeof(buf)])
+        out.data[out.len++] = *p++;
+}
+
+// Output value in 0.1 mm units as mm with fractional part only if non zero.
+static void export_coord (char axis, int16_t value)
+{
+    out.data[out.len++] = axis;
+
+    if(value < 0) {
+        out.data[out.len++] = '-';
+        value = -value;
+    }
+
+    export_uint((uint32_t)value / 10);
+
+    if(value % 10) {
+        out.data[out.len++] = '.';
+        out.data[out.len++] = '0' + value % 10;
+    }
+}
+
+// Terminate line, issue a single write for the buffered block when full.
+static void export_eol (void)
+{
+    export_puts(ASCII_EOL);
+    export_flush(false);
+}
+
+void embroidery_export (stitch_reader_t *reader, embroidery_t *api, float feedrate, stream_write_ptr write)
+{
+    stitch_delta_t target = {0};
+    stich_type_t mode = Stitch_Stop;
+    stitch_t stitch;
+
+    out.len = 0;
+    out.write = write;
+
+    export_puts("G17G21G91" ASCII_EOL "F");
+    export_uint((uint32_t)feedrate);
+    export_eol();
+
+    while(api->get_stitch(&stitch, reader)) {
+
+        if(stitch.type == Stitch_Stop) {
+            const char *color = api->get_thread_color(stitch.color);
+            out.data[out.len++] = 'T';
+            export_uint(stitch.color);
+            export_puts(" (MSG,");
+            if(strlen(color) < EXPORT_MAX_LINE - 16)
+                export_puts(color);
+            export_puts(")");
+            export_eol();
+        } else if (stitch.type != Stitch_SequinEject) {
+
+            if((target.x == 0 && target.y == 0) || mode != stitch.type) {
+                export_puts(stitch.type == Stitch_Jump ? "G0" : "G1");
+                mode = stitch.type;
+            }
+            if(stitch.delta.x != 0)
+                export_coord('X', target.x = stitch.delta.x);
+            if(stitch.delta.y != 0)
+                export_coord('Y', target.y = stitch.delta.y);
+            export_eol();
+
+            if(stitch.type == Stitch_Trim) {
+                export_puts("M0 (MSG,Trim thread)");
+                export_eol();
+            }
+        }
+    }
+
+    export_puts("M30" ASCII_EOL);
+    export_flush(true);
+}
+
+#endif // EMBROIDERY_ENABLE
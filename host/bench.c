@@ -0,0 +1,454 @@
+/*
+
+  bench.c - host benchmark and regression harness for the embroidery file decoders.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  Usage: embroidery_bench [-n <iterations>] [-c <golden file>] [-g] <file>...
+
+  Each file is decoded record by record and, when the decoder supports it, in batches. The two stitch streams,
+  the packed stitch round trip and the stream decoded back from a .emc cache written by native_write() has to be
+  identical. The stream is then compared against the golden file, if given, and decoded <iterations> times for
+  stitches/s, bytes read per stitch and vfs_read() calls per stitch. -g outputs golden file lines instead.
+
+  Values from the file header are checked against the pre-scanned stitch stream.
+
+  The golden stitch counts and hashes of the test.* fixtures are from the decoders as they were before the stitch reader
+  and batch decoding was added, of the badge.* fixtures from badge.py that wrote them. Estimates are from
+  embroidery_estimate() with the fixed parameters below.
+  Exit status is 0 if all checks passes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "embroidery.h"
+
+#define BENCH_BATCH 32          // stitches per get_stitches() call, as EMBROIDERY_DECODE_BATCH
+#define BENCH_ITERATIONS 100
+#define ESTIMATE_TOLERANCE 1e-4 // relative
+#define HEADER_TOLERANCE 0.05   // mm
+
+extern bool brother_open_file (stitch_reader_t *reader, embroidery_t *api);
+extern bool tajima_open_file (stitch_reader_t *reader, embroidery_t *api);
+extern bool native_open_file (stitch_reader_t *reader, embroidery_t *api);
+
+typedef enum {
+    Header_Records = bit(0),        // stitches is the record count, as ST: in DST
+    Header_Counts = bit(1),         // stitches, jumps, trims, threads and color changes
+    Header_ColorChanges = bit(2),
+    Header_Extents = bit(3),
+    Header_Size = bit(4)
+} bench_header_t;
+
+typedef struct {
+    const char *name;
+    open_file_ptr open;
+    uint32_t header; // bench_header_t, design values from the file header
+} bench_format_t;
+
+typedef struct {
+    uint32_t records;
+    uint32_t stitches;
+    uint32_t jumps;
+    uint32_t trims;
+    uint32_t stops;
+    uint32_t hash;
+    bool pack_error;
+} stream_result_t;
+
+typedef struct {
+    char file[64];
+    uint32_t records;
+    uint32_t stitches;
+    uint32_t jumps;
+    uint32_t trims;
+    uint32_t stops;
+    uint32_t hash;
+    double estimate;
+} golden_t;
+
+// Default settings, 4000 mm/min feedrate and 10 mm Z travel, stepper needle.
+static const embroidery_estimate_params_t estimate_params = {
+    .feedrate = 4000.0f / 60.0f,
+    .max_rate = 6000.0f / 60.0f,
+    .acceleration = 1000.0f,
+    .z_max_rate = 6000.0f / 60.0f,
+    .z_acceleration = 1000.0f,
+    .z_travel = 10.0f,
+    .needle_period = 0.0f,
+    .move_window = 0.4f,
+    .stop_delay = 0.0f,
+    .trim_time = 2.0f,
+    .color_change_time = 20.0f,
+    .hold_jumps = true
+};
+
+static const bench_format_t formats[] = {
+    { "PES", brother_open_file, Header_Size },
+    { "DST", tajima_open_file, Header_Records|Header_ColorChanges|Header_Extents },
+    { "EMC", native_open_file, Header_Counts|Header_Extents }
+};
+
+static const bench_format_t *native_format = &formats[2];
+
+static stitch_reader_t reader;
+static embroidery_index_t design_index;
+static golden_t golden[32];
+static uint_fast16_t n_golden = 0;
+
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// FNV-1a over type, thread color of Stop records and delta.
+static uint32_t hash_stitch (uint32_t hash, const stitch_t *stitch)
+{
+    int32_t value[4] = { stitch->type, stitch->type == Stitch_Stop ? stitch->color : 0, stitch->delta.x, stitch->delta.y };
+    uint_fast8_t idx, byte;
+
+    for(idx = 0; idx < 4; idx++) {
+        for(byte = 0; byte < 4; byte++) {
+            hash ^= ((uint32_t)value[idx] >> (byte * 8)) & 0xFF;
+            hash *= 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+static void add_stitch (stream_result_t *result, const stitch_t *stitch)
+{
+    stitch_t unpacked;
+    stitch_packed_t packed;
+
+    result->records++;
+    result->hash = hash_stitch(result->hash, stitch);
+
+    switch(stitch->type) {
+        case Stitch_Normal: result->stitches++; break;
+        case Stitch_Jump:   result->jumps++; break;
+        case Stitch_Trim:   result->trims++; break;
+        case Stitch_Stop:   result->stops++; break;
+        default: break;
+    }
+
+    // Packed stitches are used for the stitch queue and the native format, the round trip has to be lossless.
+    if(!stitch_pack(&packed, stitch))
+        result->pack_error = true;
+    else {
+        stitch_unpack(&unpacked, packed);
+        if(hash_stitch(0, &unpacked) != hash_stitch(0, stitch))
+            result->pack_error = true;
+    }
+}
+
+// Decodes from the current position to the end of design, record by record or in batches.
+static void decode_stream (embroidery_t *api, bool batch, stream_result_t *result)
+{
+    stitch_t stitch[BENCH_BATCH];
+    uint_fast16_t idx, n;
+
+    memset(result, 0, sizeof(stream_result_t));
+    result->hash = 2166136261u;
+
+    if(batch) do {
+        for(idx = 0, n = api->get_stitches(stitch, BENCH_BATCH, &reader); idx < n; idx++)
+            add_stitch(result, &stitch[idx]);
+    } while(n == BENCH_BATCH);
+    else while(api->get_stitch(stitch, &reader))
+        add_stitch(result, stitch);
+}
+
+static bool rewind_stream (embroidery_t *api, vfs_file_t *file, size_t offset, uint32_t state)
+{
+    stitch_reader_open(&reader, file);
+    api->set_state(state);
+
+    return stitch_reader_seek(&reader, offset);
+}
+
+static bool same_stream (const stream_result_t *a, const stream_result_t *b)
+{
+    return a->records == b->records && a->hash == b->hash;
+}
+
+// Times <iterations> decodes of the stream and outputs throughput and read statistics.
+static void bench_stream (const char *label, embroidery_t *api, bool batch, vfs_file_t *file, size_t offset, uint32_t state, uint32_t iterations)
+{
+    uint32_t idx, reads = 0, bytes = 0, records = 0;
+    double elapsed = 0.0, start;
+    stream_result_t result;
+
+    for(idx = 0; idx < iterations; idx++) {
+        rewind_stream(api, file, offset, state);
+        vfs_stats.reads = 0;
+        reader.bytes = 0;
+        start = now();
+        decode_stream(api, batch, &result);
+        elapsed += now() - start;
+        reads += vfs_stats.reads;
+        bytes += reader.bytes;
+        records += result.records;
+    }
+
+    if(records)
+        printf("  %-14s %12.0f stitches/s %8.3f bytes/stitch %8.5f reads/stitch\n", label,
+                elapsed > 0.0 ? (double)records / elapsed : 0.0, (double)bytes / records, (double)reads / records);
+}
+
+static const char *basename_of (const char *path)
+{
+    const char *name = strrchr(path, '/');
+
+    return name ? name + 1 : path;
+}
+
+static bool load_golden (const char *path)
+{
+    char line[160];
+    FILE *fp;
+
+    if((fp = fopen(path, "r")) == NULL)
+        return false;
+
+    while(n_golden < sizeof(golden) / sizeof(golden_t) && fgets(line, sizeof(line), fp)) {
+        golden_t *g = &golden[n_golden];
+        if(*line != '#' && sscanf(line, "%63s %u %u %u %u %u %x %lf", g->file, &g->records, &g->stitches, &g->jumps,
+                                   &g->trims, &g->stops, &g->hash, &g->estimate) == 8)
+            n_golden++;
+    }
+
+    fclose(fp);
+
+    return true;
+}
+
+static golden_t *find_golden (const char *file)
+{
+    uint_fast16_t idx;
+
+    for(idx = 0; idx < n_golden; idx++) {
+        if(!strcmp(golden[idx].file, file))
+            return &golden[idx];
+    }
+
+    return NULL;
+}
+
+static bool check (bool ok, const char *file, const char *what)
+{
+    if(!ok)
+        printf("  FAIL %s: %s\n", file, what);
+
+    return ok;
+}
+
+static bool same_value (float a, float b)
+{
+    return fabs(a - b) <= HEADER_TOLERANCE;
+}
+
+// Checks the values the decoder reported from the file header against the pre-scanned stitch stream.
+static bool check_header (const bench_format_t *format, const embroidery_t *header, const embroidery_t *scan, uint32_t records, const char *name)
+{
+    bool ok = true;
+    const char *c = header->name;
+
+    ok &= check(c != NULL && *c != '\0' && c[strlen(c) - 1] != ' ', name, "header name");
+    for(; ok && *c; c++)
+        ok = check(*c >= ' ' && *c < 0x7F, name, "header name");
+
+    if(format->header & Header_Records)
+        ok &= check(header->stitches == records, name, "header record count");
+
+    if(format->header & Header_Counts)
+        ok &= check(header->stitches == scan->stitches && header->jumps == scan->jumps && header->trims == scan->trims &&
+                     header->threads == scan->threads && header->color_changes == scan->color_changes, name, "header stitch counts");
+
+    if(format->header & Header_ColorChanges)
+        ok &= check(header->color_changes == scan->color_changes, name, "header color changes");
+
+    if(format->header & Header_Extents)
+        ok &= check(same_value(header->min.x, scan->min.x) && same_value(header->min.y, scan->min.y) &&
+                     same_value(header->max.x, scan->max.x) && same_value(header->max.y, scan->max.y), name, "header extents");
+
+    if(format->header & Header_Size)
+        ok &= check(same_value(header->size.x, scan->size.x) && same_value(header->size.y, scan->size.y), name, "header size");
+
+    return ok;
+}
+
+// Writes the design to a .emc cache in memory and checks that it decodes to the same stream.
+static bool check_native (const bench_format_t *format, embroidery_t *api, vfs_file_t *file, size_t offset, uint32_t state, const stream_result_t *source, const char *name, uint32_t iterations)
+{
+    bool ok;
+    size_t native_offset;
+    uint32_t records;
+    embroidery_t header, native = {0};
+    stream_result_t result;
+    vfs_stat_t st = {0};
+    vfs_file_t *cache = vfs_mem_create();
+
+    memcpy(&header, api, sizeof(embroidery_t));
+    rewind_stream(api, file, offset, state);
+
+    if(!(ok = check(embroidery_prescan(&reader, api, &design_index) && design_index.records == source->records, name, "pre-scan")))
+        return false;
+
+    records = design_index.records;
+    ok &= check_header(format, &header, api, records, name);
+
+    if((ok &= check(native_write(&reader, api, &design_index, cache, &st), name, "native write"))) {
+
+        vfs_seek(cache, 0);
+        stitch_reader_open(&reader, cache);
+
+        if((ok &= check(native_open_file(&reader, &native) && native_is_cache_of(&st), name, "native open"))) {
+
+            ok &= check_header(native_format, &native, api, records, name);
+
+            native_offset = stitch_reader_tell(&reader);
+            decode_stream(&native, true, &result);
+            ok &= check(same_stream(&result, source), name, "native stream differs from source");
+
+            stitch_reader_seek(&reader, 0);
+            ok &= check(native_load_index(&reader, &design_index) && design_index.records == records, name, "native index");
+
+            if(ok)
+                bench_stream("native batch", &native, true, cache, native_offset, 0, iterations);
+        }
+    }
+
+    vfs_mem_close(cache);
+
+    return ok;
+}
+
+static bool bench_file (const char *path, uint32_t iterations, bool output_golden)
+{
+    bool ok = true;
+    size_t offset;
+    uint32_t state;
+    uint_fast8_t idx;
+    const char *name = basename_of(path);
+    const bench_format_t *format = NULL;
+    embroidery_t api = {0};
+    embroidery_estimate_t estimate;
+    stream_result_t single, batch;
+    golden_t *g;
+    vfs_file_t *file;
+
+    if((file = vfs_mem_load(path)) == NULL)
+        return check(false, name, "cannot read file");
+
+    stitch_reader_open(&reader, file);
+
+    for(idx = 0; format == NULL && idx < sizeof(formats) / sizeof(bench_format_t); idx++) {
+        if(formats[idx].open(&reader, &api))
+            format = &formats[idx];
+    }
+
+    if(format == NULL) {
+        vfs_mem_close(file);
+        return check(false, name, "unknown format");
+    }
+
+    offset = stitch_reader_tell(&reader);
+    state = api.get_state();
+
+    rewind_stream(&api, file, offset, state);
+    decode_stream(&api, false, &single);
+
+    ok &= check(!single.pack_error, name, "packed stitch round trip");
+
+    if(api.get_stitches) {
+        rewind_stream(&api, file, offset, state);
+        decode_stream(&api, true, &batch);
+        ok &= check(same_stream(&batch, &single), name, "batch stream differs from single record stream");
+    }
+
+    rewind_stream(&api, file, offset, state);
+    ok &= check(embroidery_estimate(&reader, &api, &estimate_params, &estimate), name, "estimate");
+
+    if(output_golden)
+        printf("%s %u %u %u %u %u %08x %.3f\n", name, single.records, single.stitches, single.jumps, single.trims, single.stops, single.hash, estimate.time);
+    else {
+
+        printf("%s: %s, %u records, %u stitches, %u jumps, %u trims, %u color changes, estimate %.1f s\n", name, format->name,
+                single.records, single.stitches, single.jumps, single.trims, single.stops, estimate.time);
+
+        if((g = find_golden(name))) {
+            ok &= check(g->records == single.records && g->stitches == single.stitches && g->jumps == single.jumps &&
+                         g->trims == single.trims && g->stops == single.stops, name, "golden stitch counts");
+            ok &= check(g->hash == single.hash, name, "golden stitch stream");
+            ok &= check(fabs(estimate.time - g->estimate) <= g->estimate * ESTIMATE_TOLERANCE, name, "golden estimate");
+        } else if(n_golden)
+            printf("  no golden entry\n");
+
+        bench_stream("decode single", &api, false, file, offset, state, iterations);
+        if(api.get_stitches)
+            bench_stream("decode batch", &api, true, file, offset, state, iterations);
+
+        ok &= check_native(format, &api, file, offset, state, &single, name, iterations);
+    }
+
+    vfs_mem_close(file);
+
+    return ok;
+}
+
+int main (int argc, char **argv)
+{
+    bool ok = true, output_golden = false;
+    int arg;
+    uint32_t iterations = BENCH_ITERATIONS;
+
+    for(arg = 1; arg < argc && *argv[arg] == '-'; arg++) {
+        if(!strcmp(argv[arg], "-g"))
+            output_golden = true;
+        else if(!strcmp(argv[arg], "-n") && arg + 1 < argc)
+            iterations = (uint32_t)strtoul(argv[++arg], NULL, 10);
+        else if(!strcmp(argv[arg], "-c") && arg + 1 < argc) {
+            if(!load_golden(argv[++arg])) {
+                fprintf(stderr, "cannot read golden file %s\n", argv[arg]);
+                return 2;
+            }
+        } else
+            break;
+    }
+
+    if(arg == argc) {
+        fprintf(stderr, "usage: %s [-n <iterations>] [-c <golden file>] [-g] <file>...\n", argv[0]);
+        return 2;
+    }
+
+    for(; arg < argc; arg++)
+        ok &= bench_file(argv[arg], iterations, output_golden);
+
+    return ok ? 0 : 1;
+}
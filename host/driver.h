@@ -0,0 +1,94 @@
+/*
+
+  driver.h - minimal grblHAL environment for the host benchmark and regression harness.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  Only what the format decoders, the stitch reader, pre-scan, the native format and the estimator
+  depend on is provided. The file system is replaced by in-memory files, see vfs.c.
+*/
+
+#ifndef _DRIVER_H_
+#define _DRIVER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#define EMBROIDERY_ENABLE 1
+
+#define N_AXIS 3
+
+#define ASCII_CR  0x0D
+#define ASCII_LF  0x0A
+#define ASCII_EOF 0x1A
+
+#define bit(n) (1UL << (n))
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+typedef union {
+    float values[N_AXIS];
+    struct {
+        float x;
+        float y;
+        float z;
+    };
+} coord_data_t;
+
+typedef void (*stream_write_ptr)(const char *s);
+
+typedef struct vfs_file vfs_file_t;
+
+typedef struct {
+    size_t st_size;
+    time_t st_mtime;
+} vfs_stat_t;
+
+size_t vfs_read (void *buffer, size_t size, size_t count, vfs_file_t *file);
+size_t vfs_write (const void *buffer, size_t size, size_t count, vfs_file_t *file);
+int vfs_seek (vfs_file_t *file, size_t offset);
+size_t vfs_tell (vfs_file_t *file);
+
+char *strcaps (char *s);
+bool read_float (char *line, uint_fast8_t *char_counter, float *float_ptr);
+
+// In-memory files, host only.
+
+typedef struct {
+    uint32_t reads;  // vfs_read() calls
+    uint32_t writes; // vfs_write() calls
+} vfs_stats_t;
+
+extern vfs_stats_t vfs_stats;
+
+vfs_file_t *vfs_mem_load (const char *path);
+vfs_file_t *vfs_mem_create (void);
+void vfs_mem_close (vfs_file_t *file);
+
+#endif // _DRIVER_H_
@@ -0,0 +1,327 @@
+#!/usr/bin/env python3
+#
+# badge.py - writes the badge design used by the host regression harness as badge.dst and badge.pes.
+#
+# Part of grblHAL
+#
+# Copyright (c) 2025 Terje Io
+#
+# grblHAL is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# grblHAL is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+#
+
+# The badge is digitized as a design would be: a tatami filled disc with edge run underlay, a satin border
+# with center run underlay and a double run star, tie-in and tie-off stitches, trims and travel between objects.
+# Both files are written the way embroidery software writes them, headers (record count, color changes,
+# extents, size, palette, thumbnails) are computed from the stitch data.
+#
+# The stitch stream hash of each file is output in the golden file format for embroidery_bench to verify against.
+# Usage: badge.py [<output directory>]
+
+import math
+import os
+import struct
+import sys
+
+NAME = "badge"
+COLORS = (13, 5, 20)    # PEC palette: yellow, red, black
+
+NORMAL, TRIM, JUMP, STOP = 0, 1, 2, 3   # stich_type_t values
+
+STITCH_LENGTH = 30      # 0.1 mm
+DST_MAX = 121
+PEC_MAX = 2047
+
+
+class Design:
+
+    def __init__ (self):
+        self.records = []   # (type, x, y, color), absolute positions in 0.1 mm, Y axis up
+        self.x = self.y = 0
+
+    def add (self, type, x, y, color=0):
+        self.x, self.y = int(round(x)), int(round(y))
+        self.records.append((type, self.x, self.y, color))
+
+    def stitch (self, x, y):
+        self.add(NORMAL, x, y)
+
+    def run (self, points, length=STITCH_LENGTH):
+        # Running stitch along a polyline, segments are split into stitches of at most length.
+        for (x, y) in points:
+            dx, dy = x - self.x, y - self.y
+            n = max(1, int(math.ceil(math.hypot(dx, dy) / length)))
+            x0, y0 = self.x, self.y
+            for i in range(1, n + 1):
+                self.stitch(x0 + dx * i / n, y0 + dy * i / n)
+
+    def tie (self, x, y):
+        # Tie-in or tie-off, three short stitches back and forth towards (x, y).
+        d = math.hypot(x - self.x, y - self.y) or 1.0
+        ux, uy = (x - self.x) / d * 10, (y - self.y) / d * 10
+        x0, y0 = self.x, self.y
+        for s in (1, 0, 1, 0):
+            self.stitch(x0 + ux * s, y0 + uy * s)
+
+    def travel (self, x, y, trim=True):
+        # Trim and travel to (x, y), the encoders split the move into jumps.
+        self.add(TRIM if trim else JUMP, x, y)
+
+    def color (self, color):
+        self.add(STOP, self.x, self.y, color)
+
+
+def circle (r, step, start=0.0):
+    n = max(8, int(math.ceil(2 * math.pi * r / step)))
+    return [(r * math.cos(start + 2 * math.pi * i / n), r * math.sin(start + 2 * math.pi * i / n)) for i in range(n + 1)]
+
+
+def tatami_disc (design, r, spacing=4, length=35):
+    # Horizontal rows back and forth, stitch points staggered by a third of the stitch length from row to row.
+    rows = int(2 * r / spacing) - 1
+    for row in range(rows):
+        y = r - spacing * (row + 1)
+        half = math.sqrt(r * r - y * y)
+        offset = (row % 3) * length / 3.0
+        xs = [-half] + [x - half for x in frange(offset or length, 2 * half, length)] + [half]
+        if row & 1:
+            xs.reverse()
+        for x in xs:
+            design.stitch(x, y)
+
+
+def frange (start, stop, step):
+    while start < stop - step / 4:
+        yield start
+        start += step
+
+
+def satin_ring (design, r_inner, r_outer, spacing=4):
+    n = int(round(2 * math.pi * (r_inner + r_outer) / 2 / spacing))
+    for i in range(n + 1):
+        a = 2 * math.pi * i / n
+        r = r_inner if i & 1 == 0 else r_outer
+        design.stitch(r * math.cos(a), r * math.sin(a))
+
+
+def star (r_outer, r_inner, points=5):
+    pts = []
+    for i in range(points * 2 + 1):
+        a = math.pi / 2 + math.pi * i / points
+        r = r_outer if i & 1 == 0 else r_inner
+        pts.append((r * math.cos(a), r * math.sin(a)))
+    return pts
+
+
+def badge ():
+    d = Design()
+
+    # Yellow disc, edge run underlay then tatami fill from the top.
+    d.travel(225, 0, trim=False)
+    d.color(COLORS[0])
+    d.tie(225, 30)
+    d.run(circle(225, STITCH_LENGTH))
+    d.run([(0, 225)])
+    tatami_disc(d, 240)
+    d.tie(d.x - 30, d.y)
+
+    # Red border, center run underlay then satin.
+    d.travel(258, 0)
+    d.color(COLORS[1])
+    d.tie(258, 30)
+    d.run(circle(258, STITCH_LENGTH))
+    d.stitch(236, 0)
+    satin_ring(d, 236, 280)
+    d.tie(236, 30)
+
+    # Black star, double run.
+    points = star(170, 70)
+    d.travel(*points[0])
+    d.color(COLORS[2])
+    d.tie(*points[1])
+    d.run(points[1:], 20)
+    d.run(list(reversed(points[:-1])), 20)
+    d.tie(*points[1])
+    d.travel(0, 0)
+
+    return d.records
+
+
+def deltas (records, max_delta, min_pieces):
+    # Relative records, travel is split into jumps within max_delta, trims into at least min_pieces jumps.
+    out = []
+    x = y = 0
+    for (type, nx, ny, color) in records:
+        dx, dy = nx - x, ny - y
+        if type in (JUMP, TRIM):
+            n = max(min_pieces if type == TRIM else 1, int(math.ceil(max(abs(dx), abs(dy)) / max_delta)))
+            px = py = 0
+            for i in range(1, n + 1):
+                sx, sy = int(round(dx * i / n)), int(round(dy * i / n))
+                out.append((type if i == 1 else JUMP, sx - px, sy - py, 0))
+                px, py = sx, sy
+        else:
+            assert max(abs(dx), abs(dy)) <= max_delta
+            out.append((type, dx, dy, color))
+        x, y = nx, ny
+    return out
+
+
+def extents (stream):
+    x = y = 0
+    min_x = min_y = max_x = max_y = 0
+    for (type, dx, dy, color) in stream:
+        x, y = x + dx, y + dy
+        min_x, min_y, max_x, max_y = min(min_x, x), min(min_y, y), max(max_x, x), max(max_y, y)
+    return min_x, min_y, max_x, max_y
+
+
+def fnv1a (stream):
+    # As the embroidery_bench stitch stream hash, over type, color of Stop records and delta.
+    h = 2166136261
+    for (type, dx, dy, color) in stream:
+        for v in (type, color if type == STOP else 0, dx, dy):
+            for b in struct.pack('<i', v):
+                h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def dst_record (dx, dy, flags):
+    b = [0, 0, 0x03 | flags]
+    # Balanced ternary, (x +, x -, y +, y -) bits per trit weight.
+    bits = {1: ((0, 0x01), (0, 0x02), (0, 0x80), (0, 0x40)), 3: ((1, 0x01), (1, 0x02), (1, 0x80), (1, 0x40)),
+            9: ((0, 0x04), (0, 0x08), (0, 0x20), (0, 0x10)), 27: ((1, 0x04), (1, 0x08), (1, 0x20), (1, 0x10)),
+            81: ((2, 0x04), (2, 0x08), (2, 0x20), (2, 0x10))}
+    for axis, v in ((0, dx), (1, dy)):
+        for w in (1, 3, 9, 27, 81):
+            t = ((v + 1) % 3) - 1
+            v = (v - t) // 3
+            if t:
+                i, m = bits[w][axis * 2 + (0 if t > 0 else 1)]
+                b[i] |= m
+        assert v == 0
+    return bytes(b)
+
+
+def write_dst (path, records):
+    # DST has no thread colors and no trim command, a trim is written as three or more jumps.
+    stream = dst_stream(records)
+    body = bytearray()
+    for (type, dx, dy, color) in stream:
+        body += dst_record(dx, dy, 0xC0 if type == STOP else (0x80 if type in (JUMP, TRIM) else 0))
+    body += b'\x00\x00\xF3'
+
+    min_x, min_y, max_x, max_y = extents(stream)
+    x, y = sum(r[1] for r in stream), sum(r[2] for r in stream)
+    header = ("LA:%-16s\r" % NAME + "ST:%7d\r" % len(stream) + "CO:%3d\r" % sum(1 for r in stream if r[0] == STOP) +
+              "+X:%5d\r" % max_x + "-X:%5d\r" % -min_x + "+Y:%5d\r" % max_y + "-Y:%5d\r" % -min_y +
+              "AX:%s%5d\r" % ('-' if x < 0 else '+', abs(x)) + "AY:%s%5d\r" % ('-' if y < 0 else '+', abs(y)) +
+              "MX:+    0\r" + "MY:+    0\r" + "PD:******\r").encode('ascii') + b'\x1A'
+
+    with open(path, 'wb') as f:
+        f.write(header.ljust(512, b' ') + body)
+
+    # The DST decoder reports jumps for trims and no colors.
+    return [(JUMP if t == TRIM else t, dx, dy, 0) for (t, dx, dy, c) in stream]
+
+
+def dst_stream (records):
+    # The first color is the machine's current thread, its Stop is not written.
+    first = next(i for i, r in enumerate(records) if r[0] == STOP)
+    return deltas(records[:first] + records[first + 1:], DST_MAX, 3)
+
+
+def pec_value (v, flags):
+    if flags == 0 and -64 <= v <= 63:
+        return bytes([v & 0x7F])
+    assert -PEC_MAX - 1 <= v <= PEC_MAX
+    v &= 0xFFF
+    return bytes([0x80 | flags | (v >> 8), v & 0xFF])
+
+
+def thumbnail (stream, min_x, min_y, max_x, max_y, color=None):
+    # 48 x 38 pixel bitmap, frame and the stitches of one or all colors.
+    bmp = bytearray(6 * 38)
+
+    def pixel (px, py):
+        bmp[py * 6 + px // 8] |= 1 << (px % 8)
+
+    for px in range(4, 44):
+        pixel(px, 1), pixel(px, 36)
+    for py in range(2, 36):
+        pixel(2, py), pixel(45, py)
+
+    scale = min(36.0 / max(1, max_x - min_x), 28.0 / max(1, max_y - min_y))
+    x = y = 0
+    current = None
+    for (type, dx, dy, c) in stream:
+        x, y = x + dx, y + dy
+        if type == STOP:
+            current = c
+        elif type == NORMAL and (color is None or color == current):
+            pixel(6 + int((x - min_x) * scale), 4 + int((max_y - y) * scale))
+
+    return bytes(bmp)
+
+
+def write_pes (path, records):
+    # Version 1 PES, the PEC section follows immediately after the PES header.
+    stream = deltas(records, PEC_MAX, 1)
+    colors = [r[3] for r in stream if r[0] == STOP]
+
+    # The decoder reports the first color before any stitch record, the first Stop is not written.
+    first = next(i for i, r in enumerate(stream) if r[0] == STOP)
+    decoded = [stream[first]] + stream[:first] + stream[first + 1:]
+
+    body = bytearray()
+    toggle = 2
+    for (type, dx, dy, color) in stream[:first] + stream[first + 1:]:
+        if type == STOP:
+            body += bytes([0xFE, 0xB0, toggle])
+            toggle = 3 - toggle
+        else:
+            flags = 0x20 if type == TRIM else (0x10 if type == JUMP else 0)
+            body += pec_value(dx, flags) + pec_value(-dy, flags) # PEC Y axis is down
+    body += b'\xFF\x00'
+
+    min_x, min_y, max_x, max_y = extents(stream)
+
+    pec = bytearray(("LA:%-16s\r" % NAME).encode('ascii'))
+    pec += b' ' * 12 + b'\xFF\x00' + bytes([6, 38]) + b' ' * 12
+    pec += bytes([len(colors) - 1]) + bytes(colors) + b' ' * (463 - len(colors))
+    assert len(pec) == 512
+
+    block = b'\x31\xFF\xF0' + struct.pack('<4H', max_x - min_x, max_y - min_y, 0x1E0, 0x1B0)
+    block += struct.pack('>2H', 0x9000 | (-min_x & 0xFFF), 0x9000 | (max_y & 0xFFF))
+    pec += b'\x00\x00' + struct.pack('<I', 2 + 3 + len(block) + len(body))[:3] + block + body
+
+    pec += thumbnail(stream, min_x, min_y, max_x, max_y)
+    for color in colors:
+        pec += thumbnail(stream, min_x, min_y, max_x, max_y, color)
+
+    with open(path, 'wb') as f:
+        f.write(b'#PES0001' + struct.pack('<I', 22) + bytes(10) + pec)
+
+    return decoded
+
+
+def summary (name, stream):
+    counts = [sum(1 for r in stream if r[0] == t) for t in (NORMAL, JUMP, TRIM, STOP)]
+    return "%s %u %u %u %u %u %08x" % (name, len(stream), counts[0], counts[1], counts[2], counts[3], fnv1a(stream))
+
+
+if __name__ == '__main__':
+    out = sys.argv[1] if len(sys.argv) > 1 else os.path.dirname(os.path.abspath(__file__))
+    records = badge()
+    print(summary(NAME + ".dst", write_dst(os.path.join(out, NAME + ".dst"), records)))
+    print(summary(NAME + ".pes", write_pes(os.path.join(out, NAME + ".pes"), records)))
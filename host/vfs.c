@@ -0,0 +1,164 @@
+/*
+
+  vfs.c - in-memory files and grblHAL helpers for the host benchmark and regression harness.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "driver.h"
+
+struct vfs_file {
+    uint8_t *data;
+    size_t size;
+    size_t alloc;
+    size_t pos;
+};
+
+vfs_stats_t vfs_stats = {0};
+
+// Loads the file at path into memory, returns NULL on failure.
+vfs_file_t *vfs_mem_load (const char *path)
+{
+    long size;
+    FILE *fp;
+    vfs_file_t *file = NULL;
+
+    if((fp = fopen(path, "rb")) == NULL)
+        return NULL;
+
+    if(fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+        (file = calloc(1, sizeof(vfs_file_t))) && (file->data = malloc(size ? (size_t)size : 1))) {
+        file->size = file->alloc = (size_t)size;
+        if(fread(file->data, 1, file->size, fp) != file->size) {
+            vfs_mem_close(file);
+            file = NULL;
+        }
+    } else if(file) {
+        free(file);
+        file = NULL;
+    }
+
+    fclose(fp);
+
+    return file;
+}
+
+// Creates an empty file, grown by vfs_write().
+vfs_file_t *vfs_mem_create (void)
+{
+    return calloc(1, sizeof(vfs_file_t));
+}
+
+void vfs_mem_close (vfs_file_t *file)
+{
+    if(file) {
+        free(file->data);
+        free(file);
+    }
+}
+
+// Returns number of bytes read, as grblHAL's vfs_read().
+size_t vfs_read (void *buffer, size_t size, size_t count, vfs_file_t *file)
+{
+    size_t n = size * count;
+
+    vfs_stats.reads++;
+
+    if(n > file->size - file->pos)
+        n = file->size - file->pos;
+
+    memcpy(buffer, file->data + file->pos, n);
+    file->pos += n;
+
+    return n;
+}
+
+// Returns number of bytes written, as grblHAL's vfs_write().
+size_t vfs_write (const void *buffer, size_t size, size_t count, vfs_file_t *file)
+{
+    size_t n = size * count;
+
+    vfs_stats.writes++;
+
+    if(file->pos + n > file->alloc) {
+
+        size_t alloc = file->alloc ? file->alloc : 4096;
+        uint8_t *data;
+
+        while(alloc < file->pos + n)
+            alloc *= 2;
+
+        if((data = realloc(file->data, alloc)) == NULL)
+            return 0;
+
+        file->data = data;
+        file->alloc = alloc;
+    }
+
+    memcpy(file->data + file->pos, buffer, n);
+    file->pos += n;
+    if(file->pos > file->size)
+        file->size = file->pos;
+
+    return n;
+}
+
+int vfs_seek (vfs_file_t *file, size_t offset)
+{
+    if(offset > file->size)
+        return -1;
+
+    file->pos = offset;
+
+    return 0;
+}
+
+size_t vfs_tell (vfs_file_t *file)
+{
+    return file->pos;
+}
+
+char *strcaps (char *s)
+{
+    char *c = s;
+
+    for(; *c; c++) {
+        if(*c >= 'a' && *c <= 'z')
+            *c -= 'a' - 'A';
+    }
+
+    return s;
+}
+
+bool read_float (char *line, uint_fast8_t *char_counter, float *float_ptr)
+{
+    char *end;
+
+    *float_ptr = strtof(line + *char_counter, &end);
+
+    if(end == line + *char_counter)
+        return false;
+
+    *char_counter = (uint_fast8_t)(end - line);
+
+    return true;
+}
@@ -0,0 +1,321 @@
+/*
+
+  native.c - fixed record size stitch format, used for caching decoded designs.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  File layout, native byte order:
+
+  native_header_t
+  native_checkpoint_t[n_blocks]       - color blocks
+  native_checkpoint_t[n_checkpoints]  - periodic checkpoints
+  stitch_packed_t[records]            - stitch data
+
+  Record n is at a fixed offset in the file, the decoder state is the record index.
+*/
+
+#include "embroidery.h"
+
+#if EMBROIDERY_ENABLE
+
+#include <string.h>
+
+#define NATIVE_MAGIC "EMBC"
+#define NATIVE_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t source_size;   // size and timestamp of the file the cache was created from
+    uint32_t source_time;
+    uint32_t records;
+    uint32_t stitches;
+    uint32_t jumps;
+    uint32_t threads;
+    uint32_t trims;
+    uint32_t color_changes;
+    stitch_position_t min;
+    stitch_position_t max;
+    uint32_t interval;
+    uint16_t n_blocks;
+    uint16_t n_checkpoints;
+    char name[32];
+} native_header_t;
+
+typedef struct {
+    uint32_t stitch;
+    stitch_position_t position;
+    uint32_t color;
+} native_checkpoint_t;
+
+static native_header_t hdr;
+static uint32_t record, data_offset;
+
+static const char *get_thread_color (embroidery_thread_color_t color)
+{
+    return "None";
+}
+
+static uint32_t get_state (void)
+{
+    return record;
+}
+
+static void set_state (uint32_t state)
+{
+    record = state;
+}
+
+static inline void decode_record (stitch_t *stitch, const uint8_t *data)
+{
+    stitch_packed_t rec;
+
+    memcpy(&rec, data, sizeof(stitch_packed_t));
+    stitch_unpack(stitch, rec);
+}
+
+static bool get_stitch (stitch_t *stitch, stitch_reader_t *reader)
+{
+    stitch_packed_t rec;
+
+    if(record >= hdr.records || stitch_reader_read(reader, &rec, sizeof(stitch_packed_t)) != sizeof(stitch_packed_t))
+        return false;
+
+    decode_record(stitch, (uint8_t *)&rec);
+    record++;
+
+    return true;
+}
+
+// Batch decode, records are copied out of the read-ahead buffer.
+// Returns number of stitches decoded, less than count on end of design.
+static uint_fast16_t get_stitches (stitch_t *stitch, uint_fast16_t count, stitch_reader_t *reader)
+{
+    uint_fast16_t n = 0;
+
+    if(count > hdr.records - record)
+        count = hdr.records - record;
+
+    while(n < count) {
+
+        if(reader->len - reader->pos >= sizeof(stitch_packed_t)) {
+
+            const uint8_t *rec = reader->data + reader->pos, *end = reader->data + reader->len - (sizeof(stitch_packed_t) - 1);
+
+            while(n < count && rec < end) {
+                decode_record(stitch++, rec);
+                rec += sizeof(stitch_packed_t);
+                record++;
+                n++;
+            }
+
+            reader->pos = (uint16_t)(rec - reader->data);
+
+        } else if(get_stitch(stitch++, reader))
+            n++;
+        else
+            break;
+    }
+
+    return n;
+}
+
+bool native_open_file (stitch_reader_t *reader, embroidery_t *api)
+{
+    bool ok;
+
+    if((ok = stitch_reader_read(reader, &hdr, sizeof(native_header_t)) == sizeof(native_header_t) &&
+              !strncmp(hdr.magic, NATIVE_MAGIC, 4) && hdr.version == NATIVE_VERSION && hdr.record_size == sizeof(stitch_packed_t))) {
+
+        hdr.name[sizeof(hdr.name) - 1] = '\0';
+        data_offset = sizeof(native_header_t) + (hdr.n_blocks + hdr.n_checkpoints) * sizeof(native_checkpoint_t);
+        record = 0;
+
+        api->stitches = hdr.stitches;
+        api->jumps = hdr.jumps;
+        api->threads = hdr.threads;
+        api->trims = hdr.trims;
+        api->color_changes = hdr.color_changes;
+        api->min.x = (float)hdr.min.x / 10.0f;
+        api->min.y = (float)hdr.min.y / 10.0f;
+        api->max.x = (float)hdr.max.x / 10.0f;
+        api->max.y = (float)hdr.max.y / 10.0f;
+        api->size.x = api->max.x - api->min.x;
+        api->size.y = api->max.y - api->min.y;
+        api->get_stitch = get_stitch;
+        api->get_stitches = get_stitches;
+        api->get_state = get_state;
+        api->set_state = set_state;
+        // Keep name and thread colors from the source format decoder when opened as a cache.
+        if(api->name == NULL)
+            api->name = hdr.name;
+        if(api->get_thread_color == NULL)
+            api->get_thread_color = get_thread_color;
+
+        ok = stitch_reader_seek(reader, data_offset);
+    } else
+        stitch_reader_seek(reader, 0);
+
+    return ok;
+}
+
+// Returns true if the file opened by native_open_file() was created from source.
+bool native_is_cache_of (const vfs_stat_t *source)
+{
+    return hdr.source_size == (uint32_t)source->st_size && hdr.source_time == (uint32_t)source->st_mtime;
+}
+
+static void load_checkpoint (embroidery_checkpoint_t *cp, native_checkpoint_t *ncp)
+{
+    cp->stitch = ncp->stitch;
+    cp->position = ncp->position;
+    cp->color = (embroidery_thread_color_t)ncp->color;
+    cp->state = ncp->stitch;
+    cp->offset = data_offset + ncp->stitch * sizeof(stitch_packed_t);
+}
+
+// Loads color block and checkpoint tables from the file opened by native_open_file(), no pre-scan is required.
+bool native_load_index (stitch_reader_t *reader, embroidery_index_t *index)
+{
+    bool ok;
+    uint_fast16_t idx;
+    native_checkpoint_t ncp;
+
+    memset(index, 0, sizeof(embroidery_index_t));
+
+    if((ok = hdr.n_blocks <= EMBROIDERY_MAX_BLOCKS && hdr.n_checkpoints <= EMBROIDERY_MAX_CHECKPOINTS && hdr.interval &&
+              stitch_reader_seek(reader, sizeof(native_header_t)))) {
+
+        for(idx = 0; ok && idx < hdr.n_blocks + hdr.n_checkpoints; idx++) {
+            if((ok = stitch_reader_read(reader, &ncp, sizeof(native_checkpoint_t)) == sizeof(native_checkpoint_t)))
+                load_checkpoint(idx < hdr.n_blocks ? &index->block[index->n_blocks++] : &index->checkpoint[index->n_checkpoints++], &ncp);
+        }
+
+        index->records = hdr.records;
+        index->interval = hdr.interval;
+        index->valid = index->n_blocks == hdr.threads;
+    }
+
+    record = 0;
+
+    return stitch_reader_seek(reader, data_offset) && ok;
+}
+
+static struct {
+    vfs_file_t *file;
+    uint_fast16_t len;
+    bool error;
+    uint8_t data[STITCH_READER_BUFFER_SIZE];
+} out;
+
+// Buffered write, full buffers are written so that writes are sector aligned.
+static void out_write (const void *data, size_t size)
+{
+    size_t n;
+    const uint8_t *src = (const uint8_t *)data;
+
+    while(size && !out.error) {
+
+        n = min(size, sizeof(out.data) - out.len);
+        memcpy(&out.data[out.len], src, n);
+        out.len += n;
+        src += n;
+        size -= n;
+
+        if(out.len == sizeof(out.data)) {
+            out.error = vfs_write(out.data, 1, out.len, out.file) != out.len;
+            out.len = 0;
+        }
+    }
+}
+
+static void out_checkpoint (embroidery_checkpoint_t *cp)
+{
+    native_checkpoint_t ncp = {
+        .stitch = cp->stitch,
+        .position = cp->position,
+        .color = cp->color
+    };
+
+    out_write(&ncp, sizeof(native_checkpoint_t));
+}
+
+// Writes the design as native format to file, api and index must be filled in by embroidery_prescan().
+// The reader and decoder is restored to the start of the stitch data on return.
+bool native_write (stitch_reader_t *reader, embroidery_t *api, embroidery_index_t *index, vfs_file_t *file, const vfs_stat_t *source)
+{
+    uint_fast16_t idx;
+    stitch_t stitch;
+    stitch_packed_t rec;
+    uint32_t state = api->get_state(), records = 0;
+    size_t offset = stitch_reader_tell(reader);
+    native_header_t h = {
+        .magic = NATIVE_MAGIC,
+        .version = NATIVE_VERSION,
+        .record_size = sizeof(stitch_packed_t),
+        .source_size = (uint32_t)source->st_size,
+        .source_time = (uint32_t)source->st_mtime,
+        .records = index->records,
+        .stitches = api->stitches,
+        .jumps = api->jumps,
+        .threads = api->threads,
+        .trims = api->trims,
+        .color_changes = api->color_changes,
+        .min.x = (int32_t)(api->min.x * 10.0f + (api->min.x < 0.0f ? -0.5f : 0.5f)),
+        .min.y = (int32_t)(api->min.y * 10.0f + (api->min.y < 0.0f ? -0.5f : 0.5f)),
+        .max.x = (int32_t)(api->max.x * 10.0f + (api->max.x < 0.0f ? -0.5f : 0.5f)),
+        .max.y = (int32_t)(api->max.y * 10.0f + (api->max.y < 0.0f ? -0.5f : 0.5f)),
+        .interval = index->interval,
+        .n_blocks = index->n_blocks,
+        .n_checkpoints = index->n_checkpoints
+    };
+
+    if(api->name)
+        strncpy(h.name, api->name, sizeof(h.name) - 1);
+
+    out.file = file;
+    out.len = 0;
+    out.error = false;
+
+    out_write(&h, sizeof(native_header_t));
+
+    for(idx = 0; idx < index->n_blocks; idx++)
+        out_checkpoint(&index->block[idx]);
+
+    for(idx = 0; idx < index->n_checkpoints; idx++)
+        out_checkpoint(&index->checkpoint[idx]);
+
+    while(!out.error && api->get_stitch(&stitch, reader)) {
+        if(!(out.error = !stitch_pack(&rec, &stitch))) {
+            out_write(&rec, sizeof(stitch_packed_t));
+            records++;
+        }
+    }
+
+    if(!out.error && out.len)
+        out.error = vfs_write(out.data, 1, out.len, out.file) != out.len;
+
+    api->set_state(state);
+
+    return stitch_reader_seek(reader, offset) && !out.error && records == index->records;
+}
+
+#endif // EMBROIDERY_ENABLE
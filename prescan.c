@@ -0,0 +1,187 @@
+/*
+
+  prescan.c - scans embroidery file stitch data for statistics, bounds and color block index.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "embroidery.h"
+
+#if EMBROIDERY_ENABLE
+
+#define CHECKPOINT_INTERVAL 256 // initial periodic checkpoint interval, doubled each time the table fills up
+
+static void set_checkpoint (embroidery_checkpoint_t *cp, stitch_reader_t *reader, embroidery_t *api, uint32_t stitch, stitch_position_t *position)
+{
+    cp->offset = stitch_reader_tell(reader);
+    cp->state = api->get_state();
+    cp->stitch = stitch;
+    cp->position = *position;
+}
+
+// Decodes all stitch data and fills in counts and bounds in api.
+// Color blocks and periodic checkpoints are recorded in index, the reader and decoder is restored to the start of the stitch data on return.
+bool embroidery_prescan (stitch_reader_t *reader, embroidery_t *api, embroidery_index_t *index)
+{
+    stitch_t stitch;
+    uint32_t n = 0;
+    embroidery_checkpoint_t start, cp;
+    embroidery_thread_color_t color = 0;
+    stitch_position_t pos = {0}, min = {0}, max = {0};
+
+    memset(index, 0, sizeof(embroidery_index_t));
+    index->interval = CHECKPOINT_INTERVAL;
+
+    set_checkpoint(&start, reader, api, 0, &pos);
+
+    api->stitches = api->jumps = api->trims = api->color_changes = api->threads = 0;
+
+    while(true) {
+
+        set_checkpoint(&cp, reader, api, n, &pos);
+        cp.color = color;
+
+        if(n % index->interval == 0) {
+
+            if(index->n_checkpoints == EMBROIDERY_MAX_CHECKPOINTS) {
+
+                uint_fast16_t idx;
+
+                // Table full, keep every other checkpoint and double the interval.
+                for(idx = 1; idx < EMBROIDERY_MAX_CHECKPOINTS / 2; idx++)
+                    memcpy(&index->checkpoint[idx], &index->checkpoint[idx * 2], sizeof(embroidery_checkpoint_t));
+
+                index->n_checkpoints = EMBROIDERY_MAX_CHECKPOINTS / 2;
+                index->interval <<= 1;
+            }
+
+            if(n % index->interval == 0)
+                memcpy(&index->checkpoint[index->n_checkpoints++], &cp, sizeof(embroidery_checkpoint_t));
+        }
+
+        if(!api->get_stitch(&stitch, reader))
+            break;
+
+        switch(stitch.type) {
+
+            case Stitch_Normal:
+                api->stitches++;
+                break;
+
+            case Stitch_Jump:
+                api->jumps++;
+                break;
+
+            case Stitch_Trim:
+                api->trims++;
+                break;
+
+            case Stitch_Stop:
+                if(n)
+                    api->color_changes++;
+                color = stitch.color;
+                break;
+
+            default:
+                break;
+        }
+
+        // A color block starts with its Stop record so that resuming from it issues the thread change.
+        // Add a block at start of data for formats with no initial Stop record.
+        if(stitch.type == Stitch_Stop || n == 0) {
+
+            if(index->n_blocks < EMBROIDERY_MAX_BLOCKS) {
+                cp.color = stitch.type == Stitch_Stop ? stitch.color : 0;
+                memcpy(&index->block[index->n_blocks++], &cp, sizeof(embroidery_checkpoint_t));
+            }
+            api->threads++;
+        }
+
+        pos.x += stitch.delta.x;
+        pos.y += stitch.delta.y;
+
+        min.x = min(min.x, pos.x);
+        min.y = min(min.y, pos.y);
+        max.x = max(max.x, pos.x);
+        max.y = max(max.y, pos.y);
+
+        n++;
+    }
+
+    api->min.x = (float)min.x / 10.0f;
+    api->min.y = (float)min.y / 10.0f;
+    api->max.x = (float)max.x / 10.0f;
+    api->max.y = (float)max.y / 10.0f;
+    api->size.x = api->max.x - api->min.x;
+    api->size.y = api->max.y - api->min.y;
+
+    index->records = n;
+    index->valid = index->n_blocks == api->threads;
+
+    api->set_state(start.state);
+
+    return stitch_reader_seek(reader, start.offset);
+}
+
+// Positions reader and decoder so that the next record read is the one with index stitch.
+// Restarts from the closest preceding checkpoint, at most index->interval records are decoded.
+// On return position holds the design position and thread color before the record.
+bool embroidery_seek (stitch_reader_t *reader, embroidery_t *api, embroidery_index_t *index, uint32_t stitch, embroidery_checkpoint_t *position)
+{
+    stitch_t rec;
+    uint_fast16_t idx = stitch / index->interval;
+
+    if(index->n_checkpoints == 0 || stitch > index->records)
+        return false;
+
+    if(idx >= index->n_checkpoints)
+        idx = index->n_checkpoints - 1;
+
+    memcpy(position, &index->checkpoint[idx], sizeof(embroidery_checkpoint_t));
+
+    // Color block checkpoints may be closer.
+    for(idx = 0; idx < index->n_blocks && index->block[idx].stitch <= stitch; idx++) {
+        if(index->block[idx].stitch > position->stitch)
+            memcpy(position, &index->block[idx], sizeof(embroidery_checkpoint_t));
+    }
+
+    if(!stitch_reader_seek(reader, position->offset))
+        return false;
+
+    api->set_state(position->state);
+
+    while(position->stitch < stitch) {
+
+        if(!api->get_stitch(&rec, reader))
+            return false;
+
+        if(rec.type == Stitch_Stop)
+            position->color = rec.color;
+
+        position->position.x += rec.delta.x;
+        position->position.y += rec.delta.y;
+        position->stitch++;
+    }
+
+    position->offset = stitch_reader_tell(reader);
+    position->state = api->get_state();
+
+    return true;
+}
+
+#endif // EMBROIDERY_ENABLE
@@ -0,0 +1,130 @@
+/*
+
+  profile.c - optional hot path instrumentation for the embroidery plugin.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "embroidery.h"
+#include "profile.h"
+
+#if EMBROIDERY_ENABLE && EMBROIDERY_PROFILE
+
+#if EMBROIDERY_PROFILE_TRACE & (EMBROIDERY_PROFILE_TRACE - 1)
+#error "EMBROIDERY_PROFILE_TRACE must be a power of 2!"
+#endif
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} profile_stat_t;
+
+typedef struct {
+    profile_stage_t stage;
+    uint32_t stitch;
+    uint32_t ticks;
+} profile_event_t;
+
+static const char *stage_name[Profile_Stages] = { "DECODE", "ENQUEUE", "DISPATCH" };
+
+static uint_fast8_t trace_head;
+static uint32_t n_slow;
+static profile_stat_t stats[Profile_Stages];
+static profile_event_t trace[EMBROIDERY_PROFILE_TRACE];
+
+void profile_reset (void)
+{
+    uint_fast8_t idx;
+
+    memset(stats, 0, sizeof(stats));
+    memset(trace, 0, sizeof(trace));
+    trace_head = 0;
+    n_slow = 0;
+
+    for(idx = 0; idx < Profile_Stages; idx++)
+        stats[idx].min = UINT32_MAX;
+}
+
+void profile_init (void)
+{
+#ifdef DWT_CYCCNT
+    DEMCR |= (1UL << 24);   // TRCENA
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= 1;          // CYCCNTENA
+#endif
+
+    profile_reset();
+}
+
+void profile_record (profile_stage_t stage, uint32_t start, uint32_t stitch)
+{
+    uint32_t ticks = profile_ticks() - start;
+    profile_stat_t *stat = &stats[stage];
+
+    // Slow events are recorded once the average is established.
+    if(stat->count >= 64 && ticks > (uint32_t)(stat->total / stat->count) * EMBROIDERY_PROFILE_SLOW) {
+        trace[trace_head].stage = stage;
+        trace[trace_head].stitch = stitch;
+        trace[trace_head].ticks = ticks;
+        trace_head = (trace_head + 1) & (EMBROIDERY_PROFILE_TRACE - 1);
+        n_slow++;
+    }
+
+    stat->count++;
+    stat->total += ticks;
+    stat->min = min(stat->min, ticks);
+    stat->max = max(stat->max, ticks);
+}
+
+void profile_report (void)
+{
+    uint_fast8_t idx, n;
+
+    for(idx = 0; idx < Profile_Stages; idx++) {
+        hal.stream.write("[EMB PROFILE ");
+        hal.stream.write(stage_name[idx]);
+        hal.stream.write(":");
+        hal.stream.write(uitoa(stats[idx].count));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(stats[idx].count ? stats[idx].min : 0));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(stats[idx].count ? (uint32_t)(stats[idx].total / stats[idx].count) : 0));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(stats[idx].max));
+        hal.stream.write(" " PROFILE_UNIT "]" ASCII_EOL);
+    }
+
+    // Slow event trace, oldest first.
+    n = n_slow < EMBROIDERY_PROFILE_TRACE ? (uint_fast8_t)n_slow : EMBROIDERY_PROFILE_TRACE;
+    idx = (trace_head - n) & (EMBROIDERY_PROFILE_TRACE - 1);
+
+    while(n--) {
+        hal.stream.write("[EMB SLOW:");
+        hal.stream.write(stage_name[trace[idx].stage]);
+        hal.stream.write(",");
+        hal.stream.write(uitoa(trace[idx].stitch));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(trace[idx].ticks));
+        hal.stream.write("]" ASCII_EOL);
+        idx = (idx + 1) & (EMBROIDERY_PROFILE_TRACE - 1);
+    }
+}
+
+#endif // EMBROIDERY_ENABLE && EMBROIDERY_PROFILE
@@ -0,0 +1,86 @@
+/*
+
+  profile.h - optional hot path instrumentation for the embroidery plugin.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _EMBROIDERY_PROFILE_H_
+#define _EMBROIDERY_PROFILE_H_
+
+#ifndef EMBROIDERY_PROFILE
+#define EMBROIDERY_PROFILE 0
+#endif
+
+#if EMBROIDERY_PROFILE
+
+#ifndef EMBROIDERY_PROFILE_TRACE
+#define EMBROIDERY_PROFILE_TRACE 16 // number of slow events kept, must be a power of 2
+#endif
+#ifndef EMBROIDERY_PROFILE_SLOW
+#define EMBROIDERY_PROFILE_SLOW 4 // an event is slow if it takes longer than this times the stage average
+#endif
+
+typedef enum {
+    Profile_Decode = 0, // format decoder incl. read-ahead buffer refills
+    Profile_Enqueue,    // pipeline stages and queue push, includes decode
+    Profile_Dispatch,   // stitch dispatch to the planner
+    Profile_Stages
+} profile_stage_t;
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)
+
+#define PROFILE_UNIT "cycles"
+
+#define DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#define DEMCR      (*(volatile uint32_t *)0xE000EDFC)
+
+static inline uint32_t profile_ticks (void)
+{
+    return DWT_CYCCNT;
+}
+
+#else
+
+#define PROFILE_UNIT "us"
+
+static inline uint32_t profile_ticks (void)
+{
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+}
+
+#endif
+
+void profile_init (void);
+void profile_reset (void);
+void profile_record (profile_stage_t stage, uint32_t start, uint32_t stitch);
+void profile_report (void);
+
+#define PROFILE_START(v) uint32_t v = profile_ticks()
+#define PROFILE_END(stage, v, stitch) profile_record(stage, v, stitch)
+
+#else
+
+#define PROFILE_START(v)
+#define PROFILE_END(stage, v, stitch)
+
+#endif // EMBROIDERY_PROFILE
+
+#endif // _EMBROIDERY_PROFILE_H_
@@ -0,0 +1,149 @@
+/*
+
+  reader.c - buffered read-ahead layer for embroidery files read from SD card.
+
+  Part of grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "embroidery.h"
+
+#if EMBROIDERY_ENABLE
+
+// Refill buffer from the current (sector aligned) file offset.
+// Returns next byte or -1 on end of file.
+int16_t stitch_reader_fill (stitch_reader_t *reader)
+{
+    reader->offset += reader->len;
+    reader->pos = 0;
+
+#if EMBROIDERY_PREFETCH
+    if(reader->prefetched) {
+
+        uint8_t *data = reader->data;
+
+        reader->data = reader->next;
+        reader->next = data;
+        reader->len = reader->next_len;
+        reader->prefetched = false;
+
+        return reader->len ? reader->data[reader->pos++] : -1;
+    }
+#endif
+
+    reader->reads++;
+
+    if((reader->len = (uint16_t)vfs_read(reader->data, 1, STITCH_READER_BUFFER_SIZE, reader->file)) == 0)
+        return -1;
+
+    reader->bytes += reader->len;
+
+    return reader->data[reader->pos++];
+}
+
+// Read the block following the current one into the spare buffer, to be called when the
+// consumer has spare time so that the next refill is served from RAM.
+// Returns true if a block is prefetched.
+bool stitch_reader_prefetch (stitch_reader_t *reader)
+{
+#if EMBROIDERY_PREFETCH
+    if(!reader->prefetched && reader->len == STITCH_READER_BUFFER_SIZE) {
+        reader->reads++;
+        reader->next_len = (uint16_t)vfs_read(reader->next, 1, STITCH_READER_BUFFER_SIZE, reader->file);
+        reader->bytes += reader->next_len;
+        reader->prefetched = true;
+    }
+
+    return reader->prefetched;
+#else
+    return false;
+#endif
+}
+
+size_t stitch_reader_read (stitch_reader_t *reader, void *buf, size_t size)
+{
+    size_t n, count = 0;
+    uint8_t *dst = (uint8_t *)buf;
+
+    while(count < size) {
+
+        if(reader->pos == reader->len) {
+            if(stitch_reader_fill(reader) == -1)
+                break;
+            reader->pos--;
+        }
+
+        n = min(size - count, (size_t)(reader->len - reader->pos));
+        memcpy(dst + count, reader->data + reader->pos, n);
+        reader->pos += n;
+        count += n;
+    }
+
+    return count;
+}
+
+// Seek is free if the new offset is within the buffered block,
+// else the buffer is invalidated and next refill starts from the enclosing sector.
+bool stitch_reader_seek (stitch_reader_t *reader, size_t offset)
+{
+    if(offset >= reader->offset && offset < reader->offset + reader->len) {
+        reader->pos = (uint16_t)(offset - reader->offset);
+        return true;
+    }
+
+    size_t sector = offset & ~(size_t)(STITCH_READER_BUFFER_SIZE - 1);
+
+#if EMBROIDERY_PREFETCH
+    reader->prefetched = false;
+#endif
+
+    if(vfs_seek(reader->file, sector) != 0)
+        return false;
+
+    reader->offset = sector;
+    reader->pos = reader->len = 0;
+
+    if(offset > sector) {
+        if(stitch_reader_fill(reader) == -1 || offset - sector > reader->len)
+            return false;
+        reader->pos = (uint16_t)(offset - sector);
+    }
+
+    return true;
+}
+
+size_t stitch_reader_tell (stitch_reader_t *reader)
+{
+    return reader->offset + reader->pos;
+}
+
+bool stitch_reader_open (stitch_reader_t *reader, vfs_file_t *file)
+{
+    reader->file = file;
+    reader->offset = 0;
+    reader->pos = reader->len = 0;
+    reader->reads = reader->bytes = 0;
+#if EMBROIDERY_PREFETCH
+    reader->data = reader->buf[0];
+    reader->next = reader->buf[1];
+    reader->prefetched = false;
+#endif
+
+    return vfs_seek(file, 0) == 0;
+}
+
+#endif // EMBROIDERY_ENABLE
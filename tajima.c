@@ -30,141 +30,153 @@ typedef struct {
     uint8_t b2;
 } stitch_data_t;
 
+/*
+  DST coordinates are balanced ternary, each trit encoded as a +/- bit pair spread over the three bytes of a record.
+  The lookup tables below map the relevant nibble (or bit pair for b2) of each byte to its contribution,
+  x/y is then found with three table loads and adds instead of twenty conditional bit tests.
+*/
+
+#define DST_X(n) ((int8_t)((((n) >> 0) & 1) - (((n) >> 1) & 1) + 9 * (((n) >> 2) & 1) - 9 * (((n) >> 3) & 1)))
+#define DST_Y(n) ((int8_t)(9 * (((n) >> 1) & 1) - 9 * ((n) & 1) + (((n) >> 3) & 1) - (((n) >> 2) & 1)))
+#define DST_TABLE(f, m) { f(0) * m, f(1) * m, f(2) * m, f(3) * m, f(4) * m, f(5) * m, f(6) * m, f(7) * m, \
+                          f(8) * m, f(9) * m, f(10) * m, f(11) * m, f(12) * m, f(13) * m, f(14) * m, f(15) * m }
+
+static const int8_t x_b0[16] = DST_TABLE(DST_X, 1);     // b0 bits 0-3: +1, -1, +9, -9
+static const int8_t x_b1[16] = DST_TABLE(DST_X, 3);     // b1 bits 0-3: +3, -3, +27, -27
+static const int8_t x_b2[4] = { 0, 81, -81, 0 };        // b2 bits 2-3: +81, -81
+static const int8_t y_b0[16] = DST_TABLE(DST_Y, 1);     // b0 bits 4-7: -9, +9, -1, +1
+static const int8_t y_b1[16] = DST_TABLE(DST_Y, 3);     // b1 bits 4-7: -27, +27, -3, +3
+static const int8_t y_b2[4] = { 0, -81, 81, 0 };        // b2 bits 4-5: -81, +81
+
 static int32_t first_color = -1;
+static bool sequin_mode = false;
 
 static const char *get_thread_color (embroidery_thread_color_t color)
 {
     return "None";
 }
 
-static inline int16_t get_x (uint8_t b2, uint8_t b1, uint8_t b0)
+static uint32_t get_state (void)
+{
+    return sequin_mode;
+}
+
+static void set_state (uint32_t state)
 {
-    int16_t x = 0;
-
-    if(b2 & bit(2))
-        x += 81;
-    if(b2 & bit(3))
-        x -= 81;
-    if(b1 & bit(2))
-        x += 27;
-    if(b1 & bit(3))
-        x -= 27;
-    if(b0 & bit(2))
-        x += 9;
-    if(b0 & bit(3))
-        x -= 9;
-    if(b1 & bit(0))
-        x += 3;
-    if(b1 & bit(1))
-        x -= 3;
-    if(b0 & bit(0))
-        x += 1;
-    if(b0 & bit(1))
-        x -= 1;
-
-    return x;
+    sequin_mode = state != 0;
 }
 
-static inline int16_t get_y (uint8_t b2, uint8_t b1, uint8_t b0)
+// Decodes a single record, returns false on end of design.
+static inline bool decode_record (stitch_t *stitch, const uint8_t *rec)
 {
-    int16_t y = 0;
-
-    if(b2 & bit(5))
-        y += 81;
-    if(b2 & bit(4))
-        y -= 81;
-    if(b1 & bit(5))
-        y += 27;
-    if(b1 & bit(4))
-        y -= 27;
-    if(b0 & bit(5))
-        y += 9;
-    if(b0 & bit(4))
-        y -= 9;
-    if(b1 & bit(7))
-        y += 3;
-    if(b1 & bit(6))
-        y -= 3;
-    if(b0 & bit(7))
-        y += 1;
-    if(b0 & bit(6))
-        y -= 1;
-
-    return y;
+    uint8_t b0 = rec[0], b1 = rec[1], b2 = rec[2];
+
+    if((b2 & 0b11110011) == 0b11110011)
+        return false;
+
+    if((b2 & 0b11000011) == 0b11000011) {
+        stitch->type = Stitch_Stop;
+        stitch->color = 0; // no thread colors in DST
+    }
+    else if((b2 & 0b01000011) == 0b01000011) {
+        sequin_mode = !sequin_mode;
+        stitch->type = Stitch_Jump;
+    } else if((b2 & 0b10000011) == 0b10000011)
+        stitch->type = sequin_mode ? Stitch_SequinEject : Stitch_Jump;
+    else
+        stitch->type = Stitch_Normal;
+
+    stitch->delta.x = x_b0[b0 & 0x0F] + x_b1[b1 & 0x0F] + x_b2[(b2 >> 2) & 0x03];
+    stitch->delta.y = y_b0[b0 >> 4] + y_b1[b1 >> 4] + y_b2[(b2 >> 4) & 0x03];
+
+    return true;
 }
 
-static bool get_stitch (stitch_t *stitch, vfs_file_t *file)
+static bool get_stitch (stitch_t *stitch, stitch_reader_t *reader)
 {
-    bool sm = false;
-    int16_t dx = 0, dy = 0;
     stitch_data_t sd;
 
     if(first_color != -1) {
 
         stitch->type = Stitch_Stop;
         stitch->color = (embroidery_thread_color_t)first_color;
+        stitch->delta.x = stitch->delta.y = 0;
         first_color = -1;
 
         return true;
     }
 
-    if(vfs_read(&sd, sizeof(stitch_data_t), 1, file) == sizeof(stitch_data_t)) {
+    return stitch_reader_read(reader, &sd, sizeof(stitch_data_t)) == sizeof(stitch_data_t) && decode_record(stitch, (uint8_t *)&sd);
+}
 
-        if((sd.b2 & 0b11110011) == 0b11110011)
-            return false;
+// Batch decode, records are decoded in place from the read-ahead buffer.
+// Only the record straddling a buffer boundary is copied out via get_stitch().
+// Returns number of stitches decoded, less than count on end of design.
+static uint_fast16_t get_stitches (stitch_t *stitch, uint_fast16_t count, stitch_reader_t *reader)
+{
+    uint_fast16_t n = 0;
 
-        dx = get_x(sd.b2, sd.b1, sd.b0);
-        dy = get_y(sd.b2, sd.b1, sd.b0);
+    while(n < count) {
 
-        if((sd.b2 & 0b11000011) == 0b11000011)
-            stitch->type = Stitch_Stop;
-        else if((sd.b2 & 0b01000011) == 0b01000011)
-            sm = !sm;
-        else if((sd.b2 & 0b10000011) == 0b10000011)
-            stitch->type = sm ? Stitch_SequinEject : Stitch_Jump;
-        else
-            stitch->type = Stitch_Normal;
+        if(first_color == -1 && reader->len - reader->pos >= sizeof(stitch_data_t)) {
 
-        stitch->target.x = (float)dx / 10.0f;
-        stitch->target.y = (float)dy / 10.0f;
-    } else
-        return false;
+            const uint8_t *rec = reader->data + reader->pos, *end = reader->data + reader->len - (sizeof(stitch_data_t) - 1);
 
-    return true;
+            while(n < count && rec < end) {
+                if(!decode_record(stitch++, rec)) {
+                    // End record is consumed as by get_stitch() so that the reader position is the same for both.
+                    reader->pos = (uint16_t)(rec + sizeof(stitch_data_t) - reader->data);
+                    return n;
+                }
+                rec += sizeof(stitch_data_t);
+                n++;
+            }
+
+            reader->pos = (uint16_t)(rec - reader->data);
+
+        } else if(get_stitch(stitch++, reader))
+            n++;
+        else
+            break;
+    }
+
+    return n;
 }
 
-static bool read_meta (char *buf, vfs_file_t *file)
+static bool read_meta (char *buf, stitch_reader_t *reader)
 {
-    char c;
+    int16_t c;
 
     *buf = '\0';
-    while(vfs_read(&c, 1, 1, file) == 1) {
+    while((c = stitch_reader_getc(reader)) != -1) {
         if(c == ASCII_EOF)
             return false;
         if(c == ASCII_CR || c == ASCII_LF) {
             *buf = '\0';
             break;
         }
-        *buf++ = c;
+        *buf++ = (char)c;
     }
 
     return true;
 }
 
-bool tajima_open_file (vfs_file_t *file, embroidery_t *api)
+bool tajima_open_file (stitch_reader_t *reader, embroidery_t *api)
 {
     bool ok = false;
     static char buf[21];
 
-    if(vfs_read(buf, 3, 1, file) == 3 && !strncmp(buf, "LA:", 3)) {
+    if(stitch_reader_read(reader, buf, 3) == 3 && !strncmp(buf, "LA:", 3)) {
 
         char meta[20];
         float value;
         uint_fast8_t idx;
 
-        read_meta(buf, file); // Name
+        read_meta(buf, reader); // Name, padded with spaces
+        for(idx = strlen(buf); idx && buf[idx - 1] == ' '; idx--)
+            buf[idx - 1] = '\0';
 
-        while(read_meta(meta, file)) {
+        while(read_meta(meta, reader)) {
 
             idx = 3;
             strcaps(meta);
@@ -186,15 +198,20 @@ bool tajima_open_file (vfs_file_t *file, embroidery_t *api)
             }
         }
 
+        sequin_mode = false;
+
         api->name = buf;
         api->get_stitch = get_stitch;
+        api->get_stitches = get_stitches;
+        api->get_state = get_state;
+        api->set_state = set_state;
         api->get_thread_color = get_thread_color;
 //        first_color = pec_1.palette_index[0];
 
-        vfs_seek(file, 512);
+        stitch_reader_seek(reader, 512);
         ok = true;
     } else
-        vfs_seek(file, 0);
+        stitch_reader_seek(reader, 0);
 
     return ok;
 }